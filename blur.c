@@ -8,10 +8,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
+#include <time.h>
 
 #include "blur.h"
+#include "i3lock.h"
+#include "program_cache.h"
 
 extern Display *display;
+extern bool debug_mode;
+extern int full_screen_copies;
+extern blur_backend_t blur_backend;
+extern blur_method_t blur_method;
 
 #if DEBUG_GL
 void printShaderInfoLog(GLuint obj) {
@@ -49,37 +57,79 @@ void printProgramInfoLog(GLuint obj) {
 static const char *VERT_SHADER = "varying vec2 v_Coordinates;\n"
 
                                  "void main(void) {\n"
-                                 "gl_Position = ftransform();\n"
+                                 "gl_Position = gl_Vertex;\n"
                                  "v_Coordinates = vec2(gl_MultiTexCoord0);\n"
                                  "}\n";
-static const char *FRAG_SHADER_P1 = "#version 120\n"
-                                    "varying vec2 v_Coordinates;\n"
-
-                                    "uniform vec2 u_Scale;\n"
-                                    "uniform sampler2D u_Texture0;\n";
-
-static const char *FRAG_SHADER_F1 = "const vec2 gaussFilter[%d] = \n"
-                                    "vec2[](\n";
-static const char *FRAG_SHADER_F2 = "vec2 (%f, %f),\n";
-static const char *FRAG_SHADER_F3 = "vec2 (%f, %f)\n"
-                                    ");\n";
-
-static const char *FRAG_SHADER_P3 = "void main()\n"
-                                    "{\n"
-                                    "vec4 color = vec4(0.0,0.0,0.0,0.0);\n";
-static const char *FRAG_SHADER_F4 = "for( int i = 0; i < %d; i++ )\n";
-static const char *FRAG_SHADER_P4 =
+
+/* Two full-screen triangle strips of x, y, s, t. Texture coordinate (0, 0) is
+ * the top left pixel of pixmaps bound with texture_from_pixmap. Framebuffer
+ * objects start with the bottom row, so QUAD_FBO is flipped vertically to keep
+ * the top row first in their textures as well. */
+static const GLfloat QUAD_VERTICES[] = {
+    /* QUAD_WINDOW */
+    -1.0, 1.0, 0.0, 0.0,  /* */
+    1.0, 1.0, 1.0, 0.0,   /* */
+    -1.0, -1.0, 0.0, 1.0, /* */
+    1.0, -1.0, 1.0, 1.0,  /* */
+    /* QUAD_FBO */
+    -1.0, -1.0, 0.0, 0.0, /* */
+    1.0, -1.0, 1.0, 0.0,  /* */
+    -1.0, 1.0, 0.0, 1.0,  /* */
+    1.0, 1.0, 1.0, 1.0,   /* */
+};
+#define QUAD_WINDOW 0
+#define QUAD_FBO 4
+/* Upper bound on the texture lookups per pixel of a gaussian pass. Thanks to
+ * linear sampling this is enough for a radius of MAX_KERNEL_RADIUS. */
+#define MAX_KERNEL_TAPS 129
+#define MAX_KERNEL_RADIUS (MAX_KERNEL_TAPS - 1)
+/* Fragment uniform components taken by u_Kernel, u_Scale and u_Taps. */
+#define BLUR_UNIFORM_COMPONENTS (2 * MAX_KERNEL_TAPS + 3)
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+
+/* One pass of the gaussian. u_Kernel holds an offset in pixels and a weight
+ * for each of the u_Taps lookups, see generate_kernel(). */
+static const char *BLUR_FRAG_SHADER =
+    "#version 120\n"
+    "varying vec2 v_Coordinates;\n"
+
+    "uniform vec2 u_Scale;\n"
+    "uniform sampler2D u_Texture0;\n"
+    "uniform int u_Taps;\n"
+    "uniform vec2 u_Kernel[" TOSTRING(MAX_KERNEL_TAPS) "];\n"
+
+    "void main()\n"
+    "{\n"
+    "vec4 color = vec4(0.0,0.0,0.0,0.0);\n"
+    "for( int i = 0; i < " TOSTRING(MAX_KERNEL_TAPS) "; i++ )\n"
     "{\n"
-    "color += texture2D( u_Texture0, vec2( "
-    "v_Coordinates.x+gaussFilter[i].x*u_Scale.x, "
-    "v_Coordinates.y+gaussFilter[i].x*u_Scale.y ) )*gaussFilter[i].y;\n"
+    "if( i >= u_Taps ) break;\n"
+    "color += texture2D( u_Texture0, "
+    "v_Coordinates+u_Kernel[i].x*u_Scale )*u_Kernel[i].y;\n"
     "}\n"
     "gl_FragColor = color;\n"
     "}\n";
 
-static char *generate_fragment_shader(int blur_radius, float sigma) {
+/* A single bilinear lookup, used to step through the levels of the pyramid. */
+static const char *COPY_FRAG_SHADER =
+    "#version 120\n"
+    "varying vec2 v_Coordinates;\n"
+    "uniform sampler2D u_Texture0;\n"
+    "void main()\n"
+    "{\n"
+    "gl_FragColor = texture2D( u_Texture0, v_Coordinates );\n"
+    "}\n";
+
+/*
+ * Returns the normalized weights of a discrete gaussian kernel with the given
+ * radius. The returned array holds blur_radius + 2 entries, the last one is
+ * always zero so that pairs of weights can be read without bounds checks.
+ *
+ */
+float *generate_gaussian_weights(int blur_radius, float sigma) {
     // First, generate the normal Gaussian weights for a given sigma
-    float *standardGaussianWeights = calloc(blur_radius + 1, sizeof(float));
+    float *standardGaussianWeights = calloc(blur_radius + 2, sizeof(float));
     float sumOfWeights = 0.0;
     for (int currentGaussianWeightIndex = 0;
          currentGaussianWeightIndex < blur_radius + 1;
@@ -106,75 +156,136 @@ static char *generate_fragment_shader(int blur_radius, float sigma) {
             standardGaussianWeights[currentGaussianWeightIndex] / sumOfWeights;
     }
 
-    // From these weights we calculate the offsets to read interpolated values
-    // from
-    int numberOfOptimizedOffsets = blur_radius / 2 + (blur_radius % 2);
-    float *optimizedGaussianOffsets =
-        calloc(numberOfOptimizedOffsets, sizeof(float));
-    float *optimizedGaussianWeights =
-        calloc(numberOfOptimizedOffsets, sizeof(float));
-
-    for (int currentOptimizedOffset = 0;
-         currentOptimizedOffset < numberOfOptimizedOffsets;
-         currentOptimizedOffset++) {
-        float firstWeight =
-            standardGaussianWeights[currentOptimizedOffset * 2 + 1];
-        float secondWeight =
-            standardGaussianWeights[currentOptimizedOffset * 2 + 2];
-
-        float optimizedWeight = firstWeight + secondWeight;
-
-        optimizedGaussianWeights[currentOptimizedOffset] = optimizedWeight;
-        optimizedGaussianOffsets[currentOptimizedOffset] =
-            (firstWeight * (currentOptimizedOffset * 2 + 1) +
-             secondWeight * (currentOptimizedOffset * 2 + 2)) /
-            optimizedWeight;
-    }
-    int size = sizeof(char) * (450 + 56 * numberOfOptimizedOffsets);
-    char *output = (char *)malloc(size);
-    char buf[512];
-    strcpy(output, FRAG_SHADER_P1);
-    sprintf(buf, FRAG_SHADER_F1, 2 * numberOfOptimizedOffsets + 1);
-    strcat(output, buf);
-    sprintf(buf, FRAG_SHADER_F2, 0.0, standardGaussianWeights[0]);
-    strcat(output, buf);
-    for (int i = 0; i != numberOfOptimizedOffsets - 1; ++i) {
-        sprintf(buf, FRAG_SHADER_F2, optimizedGaussianOffsets[i],
-                optimizedGaussianWeights[i]);
-        strcat(output, buf);
-        sprintf(buf, FRAG_SHADER_F2, -optimizedGaussianOffsets[i],
-                optimizedGaussianWeights[i]);
-        strcat(output, buf);
-    }
-    sprintf(buf, FRAG_SHADER_F2,
-            optimizedGaussianOffsets[numberOfOptimizedOffsets - 1],
-            optimizedGaussianWeights[numberOfOptimizedOffsets - 1]);
-    strcat(output, buf);
-    sprintf(buf, FRAG_SHADER_F3,
-            -optimizedGaussianOffsets[numberOfOptimizedOffsets - 1],
-            optimizedGaussianWeights[numberOfOptimizedOffsets - 1]);
-    strcat(output, buf);
-    strcat(output, FRAG_SHADER_P3);
-    sprintf(buf, FRAG_SHADER_F4, 2 * numberOfOptimizedOffsets + 1);
-    strcat(output, buf);
-    strcat(output, FRAG_SHADER_P4);
-    free(standardGaussianWeights);
-    free(optimizedGaussianWeights);
-    free(optimizedGaussianOffsets);
-    return output;
+    return standardGaussianWeights;
+}
+
+/*
+ * Plans the pyramid blur for a gaussian kernel with the given radius and
+ * sigma: the image is halved levels times with a 2x2 box filter, blurred with
+ * a small gaussian (level_radius, level_sigma) and scaled back up bilinearly.
+ *
+ * The levels are chosen so that the result has the same variance as the
+ * kernel of the two-pass gaussian. Since that kernel is cut off at the
+ * radius, its variance is computed from the actual weights instead of sigma.
+ * Each box/bilinear pair at level i adds a variance of 4^i, so n levels
+ * contribute (4^n - 1) / 3 and the rest is left to the gaussian at the
+ * smallest level, which is kept at a sigma of at least MIN_LEVEL_SIGMA.
+ *
+ * If levels is 0, the plain gaussian with the original radius and sigma is
+ * used.
+ *
+ */
+#define MIN_LEVEL_SIGMA 2.0
+#define MIN_LEVEL_SIZE 16
+
+void plan_pyramid_blur(int radius, float sigma, int width, int height,
+                       int *levels, int *level_radius, float *level_sigma) {
+    float *weights = generate_gaussian_weights(radius, sigma);
+    double variance = 0;
+    for (int k = 1; k <= radius; k++) {
+        variance += 2.0 * weights[k] * k * k;
+    }
+    free(weights);
+
+    *levels = 0;
+    *level_radius = radius;
+    *level_sigma = sigma;
+    while (*levels < MAX_PYRAMID_LEVELS) {
+        const int n = *levels + 1;
+        const double scale = (double)(1 << (2 * n));
+        const double remaining = (variance - (scale - 1.0) / 3.0) / scale;
+        if (remaining < MIN_LEVEL_SIGMA * MIN_LEVEL_SIGMA ||
+            (width >> n) < MIN_LEVEL_SIZE || (height >> n) < MIN_LEVEL_SIZE) {
+            break;
+        }
+        *levels = n;
+        *level_sigma = sqrt(remaining);
+        *level_radius = ceil(3.0 * *level_sigma);
+    }
+}
+
+/*
+ * Fills kernel with the offsets and weights for BLUR_FRAG_SHADER and returns
+ * the number of taps. Pairs of neighbouring pixels are read with a single
+ * bilinear lookup between them, weighted so that the interpolation yields
+ * their weighted sum.
+ *
+ */
+static int generate_kernel(int blur_radius, float sigma,
+                           GLfloat kernel[2 * MAX_KERNEL_TAPS]) {
+    float *weights = generate_gaussian_weights(blur_radius, sigma);
+    int taps = 0;
+
+    kernel[0] = 0.0;
+    kernel[1] = weights[0];
+    taps++;
+    for (int k = 1; k <= blur_radius; k += 2) {
+        const float weight = weights[k] + weights[k + 1];
+        const float offset =
+            weight > 0 ? (weights[k] * k + weights[k + 1] * (k + 1)) / weight
+                       : k;
+        kernel[2 * taps] = offset;
+        kernel[2 * taps + 1] = weight;
+        kernel[2 * taps + 2] = -offset;
+        kernel[2 * taps + 3] = weight;
+        taps += 2;
+    }
+    free(weights);
+    return taps;
 }
 
 GLXFBConfig *configs = NULL;
 GLXContext ctx;
-Pixmap tmp;
-GLXPixmap glx_tmp;
-Pixmap tmp1;
-GLXPixmap glx_tmp1;
-GLXPixmap glx_pixmap;
 XVisualInfo *vis;
 GLuint shader_prog;
 GLuint v_shader;
-GLuint f_shader;
+static GLuint pixmap_texture;
+/* The kernel of the blur as passed to blur_image_gl(). */
+static int kernel_radius;
+static float kernel_sigma;
+
+/* A GL-owned texture which can be rendered to. */
+typedef struct {
+    GLuint fbo;
+    GLuint texture;
+    int width;
+    int height;
+} render_target_t;
+
+/* Result of the horizontal pass of the gaussian. */
+static render_target_t gauss_tmp;
+
+/* State of the pyramid blur, see plan_pyramid_blur(). pyramid[i] holds level
+ * i (the full resolution level 0 is the pixmap itself), pyramid_tmp holds the
+ * result of the horizontal pass at the smallest level. */
+static GLuint copy_prog;
+static int pyramid_levels = 0;
+static int pyramid_radius;
+static float pyramid_sigma;
+static render_target_t pyramid[MAX_PYRAMID_LEVELS + 1];
+static render_target_t pyramid_tmp;
+/* Per call state, kept around so that live mode only binds and draws. */
+static struct {
+    GLuint quad;
+    GLint scale;
+    GLint taps;
+    GLint kernel;
+    /* Size of the render targets, 0 if they need to be recreated. */
+    int width;
+    int height;
+    /* Radius of the kernel in the blur program. */
+    int radius;
+    /* The drawable ctx is current on. */
+    GLXDrawable current;
+} renderer;
+
+/* GLX pixmaps of the last pixmaps passed to blur_image_gl(). Live mode blurs
+ * from the same captured pixmap into the same window background every frame. */
+static struct {
+    Pixmap pixmap;
+    GLXPixmap glx_pixmap;
+} glx_pixmaps[2];
+
 static PFNGLXBINDTEXIMAGEEXTPROC glXBindTexImageEXT_f = NULL;
 static PFNGLXRELEASETEXIMAGEEXTPROC glXReleaseTexImageEXT_f = NULL;
 const int pixmap_config[] = {GLX_BIND_TO_TEXTURE_RGBA_EXT,
@@ -192,165 +303,620 @@ const int pixmap_attribs[] = {GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
                               GLX_TEXTURE_FORMAT_EXT,
                               GLX_TEXTURE_FORMAT_RGB_EXT, None};
 
-void glx_init(int scr, int w, int h, int radius, float sigma) {
+/* The vertex shader is shared by all programs and only compiled if one of
+ * them is not in the program cache. */
+static GLuint vertex_shader(void) {
+    if (v_shader == 0) {
+        int status;
+        v_shader = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(v_shader, 1, &VERT_SHADER, NULL);
+        glCompileShader(v_shader);
+        glGetShaderiv(v_shader, GL_COMPILE_STATUS, &status);
+#if DEBUG_GL
+        printf("V Shader: %d\n", status);
+        printShaderInfoLog(v_shader);
+#endif
+    }
+    return v_shader;
+}
+
+static GLuint link_program(const char *fragment_source) {
+    int status;
+    GLuint f_shader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(f_shader, 1, &fragment_source, NULL);
+    glCompileShader(f_shader);
+    glGetShaderiv(f_shader, GL_COMPILE_STATUS, &status);
+#if DEBUG_GL
+    printf("F Shader: %d\n", status);
+    printShaderInfoLog(f_shader);
+#endif
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader());
+    glAttachShader(program, f_shader);
+    program_cache_prepare(program);
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+#if DEBUG_GL
+    printf("Program: %d\n", status);
+    printProgramInfoLog(program);
+#endif
+    /* Only flags the shader for deletion, the program keeps using it. */
+    glDeleteShader(f_shader);
+
+    if (status != GL_TRUE) {
+        /* E.g. the kernel needs more uniforms than the driver supports. */
+        warnx("Could not link a blur shader.");
+        glDeleteProgram(program);
+        return 0;
+    }
+    program_cache_store(program, VERT_SHADER, fragment_source);
+    return program;
+}
+
+/*
+ * Returns the linked program for the given fragment shader, from the program
+ * cache if possible, or 0 if it cannot be linked.
+ *
+ */
+static GLuint compile_program(const char *fragment_source) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    GLuint program = program_cache_load(VERT_SHADER, fragment_source);
+    if (program == 0) {
+        program = link_program(fragment_source);
+    }
+    if (program == 0) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    DEBUG("GL program ready after %.2f ms\n",
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "u_Texture0"), 0);
+    return program;
+}
+
+/* Creates a texture for binding pixmaps with texture_from_pixmap. */
+static GLuint create_pixmap_texture(void) {
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return texture;
+}
+
+static void make_current(GLXDrawable drawable) {
+    if (renderer.current != drawable) {
+        glXMakeCurrent(display, drawable, ctx);
+        renderer.current = drawable;
+    }
+}
+
+/*
+ * Returns the GLX pixmap for the given pixmap, creating it if it is not
+ * cached. The entry of keep, the other pixmap of the same blur, is not
+ * replaced.
+ *
+ */
+static GLXPixmap get_glx_pixmap(Pixmap pixmap, Pixmap keep) {
+    for (int i = 0; i < 2; i++) {
+        if (glx_pixmaps[i].pixmap == pixmap) {
+            return glx_pixmaps[i].glx_pixmap;
+        }
+    }
+    const int slot = (glx_pixmaps[0].pixmap == keep) ? 1 : 0;
+    blur_release_pixmap(glx_pixmaps[slot].pixmap);
+    glx_pixmaps[slot].pixmap = pixmap;
+    glx_pixmaps[slot].glx_pixmap =
+        glXCreatePixmap(display, configs[0], pixmap, pixmap_attribs);
+    return glx_pixmaps[slot].glx_pixmap;
+}
+
+static bool create_render_target(render_target_t *target, int width,
+                                 int height) {
+    target->width = width;
+    target->height = height;
+
+    glGenTextures(1, &target->texture);
+    glBindTexture(GL_TEXTURE_2D, target->texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_BGRA,
+                 GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           target->texture, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE) {
+        warnx("Could not create a %dx%d framebuffer object (status 0x%x).",
+              width, height, status);
+        return false;
+    }
+    return true;
+}
+
+static void free_render_target(render_target_t *target) {
+    glDeleteFramebuffers(1, &target->fbo);
+    glDeleteTextures(1, &target->texture);
+    target->fbo = 0;
+    target->texture = 0;
+}
+
+/*
+ * Passes the gaussian kernel with the given radius and sigma to the blur
+ * program. Changing the kernel does not need a new shader. Returns false if
+ * the kernel does not fit into the shader, so that the caller can leave the
+ * radius to the CPU backend instead of blurring less than asked for.
+ *
+ */
+static bool upload_kernel(int radius, float sigma) {
+    GLfloat kernel[2 * MAX_KERNEL_TAPS];
+    if (radius > MAX_KERNEL_RADIUS) {
+        warnx("Blur radius %d is too large for the GL backend (at most %d).",
+              radius, MAX_KERNEL_RADIUS);
+        return false;
+    }
+    const int taps = generate_kernel(radius, sigma, kernel);
+    renderer.radius = radius;
+    DEBUG("GL blur kernel: radius %d, sigma %.2f, %d taps\n", radius, sigma,
+          taps);
+
+    glUseProgram(shader_prog);
+    glUniform1i(renderer.taps, taps);
+    glUniform2fv(renderer.kernel, taps, kernel);
+    return true;
+}
+
+static void pyramid_free(void) {
+    for (int i = 1; i <= pyramid_levels; i++) {
+        free_render_target(&pyramid[i]);
+    }
+    if (pyramid_levels > 0) {
+        free_render_target(&pyramid_tmp);
+    }
+    pyramid_levels = 0;
+}
+
+/*
+ * Allocates the pyramid levels for blurring a w x h screen with the current
+ * kernel.
+ *
+ */
+static void pyramid_init(int w, int h) {
+    int levels;
+    plan_pyramid_blur(kernel_radius, kernel_sigma, w, h, &levels,
+                      &pyramid_radius, &pyramid_sigma);
+
+    bool ok = true;
+    for (int i = 1; i <= levels; i++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+        ok &= create_render_target(&pyramid[i], w, h);
+    }
+    if (levels > 0) {
+        ok &= create_render_target(&pyramid_tmp, w, h);
+    }
+    pyramid_levels = levels;
+
+    if (!ok) {
+        warnx("Using the two-pass gaussian instead of the pyramid blur.");
+        pyramid_free();
+    }
+}
+
+/*
+ * Allocates the render targets for blurring a w x h screen. Returns false if
+ * neither the pyramid nor the gaussian can be used.
+ *
+ */
+static bool render_targets_init(int w, int h) {
+    renderer.width = w;
+    renderer.height = h;
+    if (blur_method == BLUR_METHOD_PYRAMID) {
+        pyramid_init(w, h);
+    }
+    if (pyramid_levels > 0) {
+        return upload_kernel(pyramid_radius, pyramid_sigma);
+    }
+    if (!upload_kernel(kernel_radius, kernel_sigma)) {
+        return false;
+    }
+    if (!create_render_target(&gauss_tmp, w, h)) {
+        free_render_target(&gauss_tmp);
+        return false;
+    }
+    return true;
+}
+
+static void render_targets_free(void) {
+    pyramid_free();
+    if (gauss_tmp.fbo != 0) {
+        free_render_target(&gauss_tmp);
+    }
+    renderer.width = 0;
+    renderer.height = 0;
+}
+
+/*
+ * Sets up the GLX context, the intermediate framebuffer objects and the blur
+ * shader. The context is made current on the given pixmap.
+ *
+ * Returns false if the X server or the GL driver lacks
+ * GLX_EXT_texture_from_pixmap, has too few fragment uniforms for the kernel,
+ * cannot link the shaders or if the radius is too large for the gaussian, in
+ * which case the caller should fall back to the CPU implementation.
+ *
+ */
+bool glx_init(int scr, Pixmap pixmap, int w, int h, int radius,
+              float sigma) {
     int i;
-    configs = glXChooseFBConfig(display, scr, pixmap_config, &i);
-    vis = glXGetVisualFromFBConfig(display, configs[0]);
-    ctx = glXCreateContext(display, vis, NULL, True);
+    const char *glx_extensions = glXQueryExtensionsString(display, scr);
+    if (glx_extensions == NULL ||
+        strstr(glx_extensions, "GLX_EXT_texture_from_pixmap") == NULL) {
+        warnx("GLX_EXT_texture_from_pixmap is not supported.");
+        return false;
+    }
 
     glXBindTexImageEXT_f = (PFNGLXBINDTEXIMAGEEXTPROC)glXGetProcAddress(
         (GLubyte *)"glXBindTexImageEXT");
     if (glXBindTexImageEXT_f == NULL) {
-        errx(EXIT_FAILURE, "Failed to load extension glXBindTexImageEXT.\n");
+        warnx("Failed to load extension glXBindTexImageEXT.");
+        return false;
     }
 
     glXReleaseTexImageEXT_f = (PFNGLXRELEASETEXIMAGEEXTPROC)glXGetProcAddress(
         (GLubyte *)"glXReleaseTexImageEXT");
 
     if (glXReleaseTexImageEXT_f == NULL) {
-        errx(EXIT_FAILURE, "Failed to load extension glXReleaseTexImageEXT.\n");
+        warnx("Failed to load extension glXReleaseTexImageEXT.");
+        return false;
     }
 
-    tmp = XCreatePixmap(display, RootWindow(display, vis->screen), w, h,
-                        vis->depth);
-    glx_tmp = glXCreatePixmap(display, configs[0], tmp, pixmap_attribs);
-    glXMakeCurrent(display, glx_tmp, ctx);
+    configs = glXChooseFBConfig(display, scr, pixmap_config, &i);
+    if (configs == NULL || i == 0) {
+        warnx("No GLX framebuffer configuration can be bound to a texture.");
+        if (configs != NULL) {
+            XFree(configs);
+            configs = NULL;
+        }
+        return false;
+    }
+    vis = glXGetVisualFromFBConfig(display, configs[0]);
+    ctx = glXCreateContext(display, vis, NULL, True);
 
-    tmp1 = XCreatePixmap(display, RootWindow(display, vis->screen), w, h,
-                         vis->depth);
-    glx_tmp1 = glXCreatePixmap(display, configs[0], tmp1, pixmap_attribs);
+    make_current(get_glx_pixmap(pixmap, None));
+
+    /* GL 2.1 only guarantees 64 components, which is far less than u_Kernel
+     * takes. Not every driver says why linking the shader fails then. */
+    GLint components = 0;
+    glGetIntegerv(GL_MAX_FRAGMENT_UNIFORM_COMPONENTS, &components);
+    if (components < BLUR_UNIFORM_COMPONENTS) {
+        warnx("The GL driver supports %d fragment uniform components, the "
+              "blur shader needs %d.",
+              components, BLUR_UNIFORM_COMPONENTS);
+        glx_deinit();
+        return false;
+    }
 
-    v_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(v_shader, 1, &VERT_SHADER, NULL);
-    glCompileShader(v_shader);
-    glGetShaderiv(v_shader, GL_COMPILE_STATUS, &i);
-#if DEBUG_GL
-    printf("V Shader: %d\n", i);
-    printShaderInfoLog(v_shader);
-#endif
-    f_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    char *fragment_shader = generate_fragment_shader(radius, sigma);
-    GLchar const *files[] = {fragment_shader};
-    glShaderSource(f_shader, 1, files, NULL);
-    free(fragment_shader);
-    glCompileShader(f_shader);
-    glGetShaderiv(f_shader, GL_COMPILE_STATUS, &i);
-#if DEBUG_GL
-    printf("F Shader: %d\n", i);
-    printShaderInfoLog(f_shader);
-#endif
-    shader_prog = glCreateProgram();
-    glAttachShader(shader_prog, v_shader);
-    glAttachShader(shader_prog, f_shader);
-    glLinkProgram(shader_prog);
-    glGetShaderiv(f_shader, GL_LINK_STATUS, &i);
-#if DEBUG_GL
-    printf("Program: %d\n", i);
-    printShaderInfoLog(f_shader);
-    printProgramInfoLog(shader_prog);
-#endif
-}
+    /* Every pass sets a scissor box, so that only the damaged part of the
+     * screen is blurred in live mode. */
+    glEnable(GL_SCISSOR_TEST);
+
+    glGenBuffers(1, &renderer.quad);
+    glBindBuffer(GL_ARRAY_BUFFER, renderer.quad);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(QUAD_VERTICES), QUAD_VERTICES,
+                 GL_STATIC_DRAW);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 4 * sizeof(GLfloat), (void *)0);
+    glTexCoordPointer(2, GL_FLOAT, 4 * sizeof(GLfloat),
+                      (void *)(2 * sizeof(GLfloat)));
+
+    shader_prog = compile_program(BLUR_FRAG_SHADER);
+    renderer.scale = glGetUniformLocation(shader_prog, "u_Scale");
+    renderer.taps = glGetUniformLocation(shader_prog, "u_Taps");
+    renderer.kernel = glGetUniformLocation(shader_prog, "u_Kernel");
 
-static void glx_free_pixmaps(void) {
-    glXDestroyPixmap(display, glx_tmp);
-    glXDestroyPixmap(display, glx_tmp1);
-    XFreePixmap(display, tmp);
-    XFreePixmap(display, tmp1);
+    kernel_radius = radius;
+    kernel_sigma = sigma;
+
+    pixmap_texture = create_pixmap_texture();
+
+    if (blur_method == BLUR_METHOD_PYRAMID) {
+        copy_prog = compile_program(COPY_FRAG_SHADER);
+    }
+    if (shader_prog == 0 ||
+        (blur_method == BLUR_METHOD_PYRAMID && copy_prog == 0) ||
+        !render_targets_init(w, h)) {
+        glx_deinit();
+        return false;
+    }
+    return true;
 }
 
-void glx_resize(int w, int h) {
-    /* free old pixmaps */
-    glx_free_pixmaps();
-
-    /* create new pixmaps */
-    tmp = XCreatePixmap(display, RootWindow(display, vis->screen), w, h,
-                        vis->depth);
-    glx_tmp = glXCreatePixmap(display, configs[0], tmp, pixmap_attribs);
-    glXMakeCurrent(display, glx_tmp, ctx);
-    tmp1 = XCreatePixmap(display, RootWindow(display, vis->screen), w, h,
-                         vis->depth);
-    glx_tmp1 = glXCreatePixmap(display, configs[0], tmp1, pixmap_attribs);
+/*
+ * Frees the render targets of the old screen size. They are recreated by the
+ * next blur_image_gl(), which also knows whether the kernel changed with the
+ * resolution.
+ *
+ */
+void glx_free_render_targets(void) {
+    if (configs == NULL) {
+        return;
+    }
+    render_targets_free();
 }
 
 void glx_deinit(void) {
-    glx_free_pixmaps();
-    glDetachShader(shader_prog, v_shader);
-    glDetachShader(shader_prog, f_shader);
-    glDeleteShader(v_shader);
-    glDeleteShader(f_shader);
+    if (configs == NULL) {
+        return;
+    }
+
+    render_targets_free();
+    glDeleteBuffers(1, &renderer.quad);
+    glDeleteTextures(1, &pixmap_texture);
     glDeleteProgram(shader_prog);
+    if (copy_prog != 0) {
+        glDeleteProgram(copy_prog);
+        copy_prog = 0;
+    }
+    if (v_shader != 0) {
+        glDeleteShader(v_shader);
+        v_shader = 0;
+    }
+    glXMakeCurrent(display, None, NULL);
+    renderer.current = None;
+    for (int i = 0; i < 2; i++) {
+        blur_release_pixmap(glx_pixmaps[i].pixmap);
+    }
     glXDestroyContext(display, ctx);
     XFree(vis);
     XFree(configs);
+    configs = NULL;
 }
 
-void blur_image_gl(int scr, Pixmap pixmap, int width, int height, int radius,
-                   float sigma) {
-    if (configs == NULL) {
-        glx_init(scr, width, height, radius, sigma);
+/*
+ * Destroys the GLX pixmap cached for the given pixmap. Must be called before
+ * freeing a pixmap that was passed to blur_image() or blur_image_region().
+ *
+ */
+void blur_release_pixmap(Pixmap pixmap) {
+    for (int i = 0; pixmap != None && i < 2; i++) {
+        if (glx_pixmaps[i].pixmap == pixmap) {
+            /* If the pixmap is still current, GLX defers this until the next
+             * make_current(). */
+            glXDestroyPixmap(display, glx_pixmaps[i].glx_pixmap);
+            glx_pixmaps[i].pixmap = None;
+            glx_pixmaps[i].glx_pixmap = None;
+        }
     }
+}
 
-    glx_pixmap = glXCreatePixmap(display, configs[0], pixmap, pixmap_attribs);
+static void draw_quad(int first) {
+    glDrawArrays(GL_TRIANGLE_STRIP, first, 4);
+}
 
-    for (uint8_t i = 0; i < 2; ++i) {
-        if ((i & 1) == 0) {
-            glXMakeCurrent(display, glx_tmp, ctx);
-        } else {
-            glXMakeCurrent(display, glx_tmp1, ctx);
-        }
-        glEnable(GL_TEXTURE_2D);
-        if (i == 0) {
-            glXBindTexImageEXT_f(display, glx_pixmap, GLX_FRONT_EXT, NULL);
-        } else {
-            glXBindTexImageEXT_f(display, (i & 1) == 1 ? glx_tmp : glx_tmp1,
-                                 GLX_FRONT_EXT, NULL);
-        }
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
+static void render_to(const render_target_t *target, GLuint texture) {
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glViewport(0, 0, target->width, target->height);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    draw_quad(QUAD_FBO);
+}
 
-        glViewport(0, 0, (GLsizei)width, (GLsizei)height);
-        glClearColor(0.3, 0.3, 0.3, 1.0);
-        glClear(GL_COLOR_BUFFER_BIT);
+/* Restricts drawing into the pixmap to the given area. GL puts the origin of
+ * the pixmap in the bottom left corner. */
+static void scissor_pixmap(XRectangle area, int height) {
+    glScissor(area.x, height - area.y - area.height, area.width,
+              area.height);
+}
 
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(-1.0, 1.0, -1.0, 1.0, -1., 1);
+/*
+ * Restricts drawing into the given pyramid level to the part covering the
+ * full resolution region from (x0, y0) to (x1, y1). The rows of a render
+ * target are stored top first, see QUAD_FBO.
+ *
+ */
+static void scissor_level(int level, int x0, int y0, int x1, int y1) {
+    const int scale = 1 << level;
+    const render_target_t *target = &pyramid[level];
+    x0 /= scale;
+    y0 /= scale;
+    x1 = MIN((x1 + scale - 1) / scale, target->width);
+    y1 = MIN((y1 + scale - 1) / scale, target->height);
+    glScissor(x0, y0, x1 - x0, y1 - y0);
+}
 
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
+/*
+ * Renders the pyramid blur of the given area of src into the current
+ * drawable. Only the part of each level which the area depends on is
+ * rendered.
+ *
+ */
+static void blur_pyramid_gl(GLXPixmap src, int width, int height,
+                            XRectangle area) {
+    const int n = pyramid_levels;
+    const int reach = (pyramid_radius + 4) << n;
+    const int x0 = MAX(area.x - reach, 0);
+    const int y0 = MAX(area.y - reach, 0);
+    const int x1 = MIN(area.x + area.width + reach, width);
+    const int y1 = MIN(area.y + area.height + reach, height);
+
+    /* Halve the resolution down to the smallest level. Each output pixel
+     * lies on the corner of four input pixels, so bilinear filtering averages
+     * them. */
+    glUseProgram(copy_prog);
+    glBindTexture(GL_TEXTURE_2D, pixmap_texture);
+    glXBindTexImageEXT_f(display, src, GLX_FRONT_EXT, NULL);
+    scissor_level(1, x0, y0, x1, y1);
+    render_to(&pyramid[1], pixmap_texture);
+    glXReleaseTexImageEXT_f(display, src, GLX_FRONT_EXT);
+    for (int i = 1; i < n; i++) {
+        scissor_level(i + 1, x0, y0, x1, y1);
+        render_to(&pyramid[i + 1], pyramid[i].texture);
+    }
 
-        glColor3f(0.0, 0.0, 1.0);
+    /* Gaussian at the smallest level */
+    glUseProgram(shader_prog);
+    scissor_level(n, x0, y0, x1, y1);
+    glUniform2f(renderer.scale, 1.0 / pyramid[n].width, 0);
+    render_to(&pyramid_tmp, pyramid[n].texture);
+    glUniform2f(renderer.scale, 0, 1.0 / pyramid[n].height);
+    render_to(&pyramid[n], pyramid_tmp.texture);
+
+    /* And back up again, the last step goes to the pixmap. */
+    glUseProgram(copy_prog);
+    for (int i = n - 1; i >= 1; i--) {
+        scissor_level(i, x0, y0, x1, y1);
+        render_to(&pyramid[i], pyramid[i + 1].texture);
+    }
 
-        glUseProgram(shader_prog);
-        GLint u_Scale = glGetUniformLocation(shader_prog, "u_Scale");
-        if ((i & 1) == 0) {
-            glUniform2f(u_Scale, 1.0 / width, 0);
-        } else {
-            glUniform2f(u_Scale, 0, 1.0 / height);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, width, height);
+    scissor_pixmap(area, height);
+    glBindTexture(GL_TEXTURE_2D, pyramid[1].texture);
+    draw_quad(QUAD_WINDOW);
+}
+
+/*
+ * Blurs the given area of src into dst using the GLX backend. The last pass
+ * renders straight into dst, so the result is not copied anywhere. src and
+ * dst may be the same pixmap.
+ *
+ * Returns false if the GLX backend cannot be initialized or cannot blur with
+ * the given radius. The backend is torn down then.
+ *
+ */
+bool blur_image_gl(int scr, Pixmap src, Pixmap dst, int width, int height,
+                   XRectangle area, int radius, float sigma) {
+    if (configs == NULL && !glx_init(scr, dst, width, height, radius, sigma)) {
+        return false;
+    }
+
+    const bool kernel_changed = radius != kernel_radius || sigma != kernel_sigma;
+    if (width != renderer.width || height != renderer.height ||
+        (kernel_changed && blur_method == BLUR_METHOD_PYRAMID)) {
+        /* The number of pyramid levels depends on the kernel as well. */
+        kernel_radius = radius;
+        kernel_sigma = sigma;
+        render_targets_free();
+        if (!render_targets_init(width, height)) {
+            warnx("Could not resize the GL blur buffers.");
+            glx_deinit();
+            return false;
+        }
+    } else if (kernel_changed) {
+        kernel_radius = radius;
+        kernel_sigma = sigma;
+        if (!upload_kernel(radius, sigma)) {
+            glx_deinit();
+            return false;
         }
+    }
 
-        glBegin(GL_QUADS);
-        glTexCoord2f(0.0, 0.0);
-        glVertex2f(-1.0, 1.0);
-        glTexCoord2f(1.0, 0.0);
-        glVertex2f(1.0, 1.0);
-        glTexCoord2f(1.0, 1.0);
-        glVertex2f(1.0, -1.0);
-        glTexCoord2f(0.0, 1.0);
-        glVertex2f(-1.0, -1.0);
-        glEnd();
-        glFlush();
-
-        if (i == 0) {
-            glXReleaseTexImageEXT_f(display, glx_pixmap, GLX_FRONT_EXT);
-        } else {
-            glXReleaseTexImageEXT_f(display, (i & 1) == 1 ? glx_tmp : glx_tmp1,
-                                    GLX_FRONT_EXT);
+    const GLXPixmap glx_src = get_glx_pixmap(src, dst);
+    make_current(get_glx_pixmap(dst, src));
+    if (pyramid_levels > 0) {
+        blur_pyramid_gl(glx_src, width, height, area);
+    } else {
+        /* Horizontal pass from src into gauss_tmp, covering the rows the
+         * vertical pass from there into dst reads. */
+        const int y0 = MAX(area.y - renderer.radius, 0);
+        const int y1 = MIN(area.y + area.height + renderer.radius, height);
+        glUseProgram(shader_prog);
+        glBindTexture(GL_TEXTURE_2D, pixmap_texture);
+        glXBindTexImageEXT_f(display, glx_src, GLX_FRONT_EXT, NULL);
+        glScissor(area.x, y0, area.width, y1 - y0);
+        glUniform2f(renderer.scale, 1.0 / width, 0);
+        render_to(&gauss_tmp, pixmap_texture);
+        glXReleaseTexImageEXT_f(display, glx_src, GLX_FRONT_EXT);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        scissor_pixmap(area, height);
+        glBindTexture(GL_TEXTURE_2D, gauss_tmp.texture);
+        glUniform2f(renderer.scale, 0, 1.0 / height);
+        draw_quad(QUAD_WINDOW);
+    }
+    /* The caller continues drawing on the pixmap with X requests. */
+    glXWaitGL();
+    if (area.width == width && area.height == height) {
+        full_screen_copies++;
+    }
+    return true;
+}
+
+/*
+ * Returns how far the blur of a pixel reaches, that is, how far around a
+ * changed area of the screen the blurred image changes as well.
+ *
+ */
+int blur_reach(int radius, float sigma, int width, int height) {
+    if (blur_method == BLUR_METHOD_PYRAMID) {
+        int levels, level_radius;
+        float level_sigma;
+        plan_pyramid_blur(radius, sigma, width, height, &levels, &level_radius,
+                          &level_sigma);
+        if (levels > 0) {
+            /* The gaussian at the smallest level, plus a few pixels for the
+             * bilinear resampling on each level. */
+            return (level_radius + 4) << levels;
         }
     }
-    GC gc = XCreateGC(display, pixmap, 0, NULL);
-    XCopyArea(display, tmp1, pixmap, gc, 0, 0, width, height, 0, 0);
-    XFreeGC(display, gc);
-    glXDestroyPixmap(display, glx_pixmap);
+    return radius;
+}
+
+/*
+ * Blurs the given area of src into dst with the configured backend. Pixels of
+ * dst outside of the area are left untouched. If the GLX backend cannot be
+ * used, this permanently switches to the CPU backend.
+ *
+ */
+void blur_image_region(int scr, Pixmap src, Pixmap dst, int width, int height,
+                       XRectangle area, int radius, float sigma) {
+    struct timespec start, start_cpu;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_cpu);
+
+    if (blur_backend == BLUR_BACKEND_GL &&
+        !blur_image_gl(scr, src, dst, width, height, area, radius, sigma)) {
+        warnx("Falling back to the CPU blur backend.");
+        blur_backend = BLUR_BACKEND_CPU;
+    }
+
+    if (blur_backend == BLUR_BACKEND_CPU) {
+        blur_image_cpu(src, dst, width, height, area, radius, sigma);
+    }
+
+    struct timespec end, end_cpu;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end_cpu);
+    DEBUG("blur of %dx%d+%d+%d: %.3f ms, %.3f ms of CPU time\n", area.width,
+          area.height, area.x, area.y,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6,
+          (end_cpu.tv_sec - start_cpu.tv_sec) * 1e3 +
+              (end_cpu.tv_nsec - start_cpu.tv_nsec) / 1e6);
+}
+
+/*
+ * Blurs the given pixmap in place with the configured backend.
+ *
+ */
+void blur_image(int scr, Pixmap pixmap, int width, int height, int radius,
+                float sigma) {
+    const XRectangle area = {0, 0, width, height};
+    blur_image_region(scr, pixmap, pixmap, width, height, area, radius, sigma);
 }
@@ -1,9 +1,41 @@
 #include <X11/Xlib.h>
 #include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <xcb/xcb.h>
 
-void blur_image_gl(int scr, Pixmap pixmap, int width, int height, int radius,
-                   float sigma);
-void glx_init(int scr, int w, int h, int radius, float sigma);
+typedef enum {
+    BLUR_BACKEND_GL = 0, /* GLSL shaders on texture_from_pixmap (default) */
+    BLUR_BACKEND_CPU = 1, /* multi-threaded SIMD implementation */
+} blur_backend_t;
+
+typedef enum {
+    BLUR_METHOD_GAUSSIAN = 0, /* two-pass gaussian at full resolution */
+    BLUR_METHOD_PYRAMID = 1, /* gaussian on a downsampled image */
+} blur_method_t;
+
+/* Upper bound on the number of levels of the pyramid blur. */
+#define MAX_PYRAMID_LEVELS 8
+
+void blur_image(int scr, Pixmap pixmap, int width, int height, int radius,
+                float sigma);
+void blur_image_region(int scr, Pixmap src, Pixmap dst, int width, int height,
+                       XRectangle area, int radius, float sigma);
+int blur_reach(int radius, float sigma, int width, int height);
+bool blur_image_gl(int scr, Pixmap src, Pixmap dst, int width, int height,
+                   XRectangle area, int radius, float sigma);
+bool glx_init(int scr, Pixmap pixmap, int w, int h, int radius,
+              float sigma);
 void glx_deinit(void);
-void glx_resize(int w, int h);
+void glx_free_render_targets(void);
+void blur_release_pixmap(Pixmap pixmap);
+float *generate_gaussian_weights(int blur_radius, float sigma);
+void plan_pyramid_blur(int radius, float sigma, int width, int height,
+                       int *levels, int *level_radius, float *level_sigma);
+
+void blur_image_cpu(Pixmap src, Pixmap dst, int width, int height,
+                    XRectangle area, int radius, float sigma);
+void blur_buffer_cpu(uint8_t *data, int width, int height, int stride,
+                     int radius, float sigma);
+void blur_pyramid_cpu(uint8_t *data, int width, int height, int stride,
+                      int levels, int level_radius, float level_sigma);
@@ -0,0 +1,831 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * blur_cpu.c: Separable gaussian blur on the CPU, for X servers or GL drivers
+ *             without GLX_EXT_texture_from_pixmap. Rows are distributed over
+ *             a pool of worker threads and convolved with SSE2 or AVX2,
+ *             depending on what the CPU supports. Also implements the
+ *             downsampled pyramid variant of the blur.
+ *
+ */
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <err.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/param.h>
+#include <sys/shm.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <xcb/shm.h>
+#include <xcb/xcb.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLUR_CPU_X86 1
+#endif
+
+#include "blur.h"
+#include "i3lock.h"
+
+extern Display *display;
+extern xcb_connection_t *conn;
+extern bool debug_mode;
+extern blur_method_t blur_method;
+extern int full_screen_copies;
+
+/* Kernel weights are fixed point numbers with 14 fractional bits, so that even
+ * a center weight of 1.0 fits into the signed 16 bit lanes of pmaddwd. */
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+/* Number of rows a thread claims from the pool at once. */
+#define ROWS_PER_CHUNK 8
+
+#define MAX_THREADS 64
+
+/* A one-dimensional kernel. The number of taps is always even (padded with a
+ * zero weight) so that the SIMD implementations can process pairs of taps. */
+typedef struct {
+    int taps;
+    int16_t *weights;
+    /* weights[k] and weights[k + 1] packed into one 32 bit integer */
+    int32_t *pairs;
+} kernel_t;
+
+/* Computes dst[i] = sum(weights[k] * src[k][i]) for i in [0, len). */
+typedef void (*convolve_fn_t)(uint8_t *dst, const uint8_t **src,
+                              const kernel_t *kernel, int len);
+
+static void convolve_range(uint8_t *dst, const uint8_t **src,
+                           const kernel_t *kernel, int from, int to) {
+    for (int i = from; i < to; i++) {
+        int32_t acc = WEIGHT_ONE / 2;
+        for (int k = 0; k < kernel->taps; k++) {
+            acc += kernel->weights[k] * src[k][i];
+        }
+        /* The weights sum up to WEIGHT_ONE, so this never exceeds 255. */
+        dst[i] = acc >> WEIGHT_BITS;
+    }
+}
+
+static void convolve_scalar(uint8_t *dst, const uint8_t **src,
+                            const kernel_t *kernel, int len) {
+    convolve_range(dst, src, kernel, 0, len);
+}
+
+#ifdef BLUR_CPU_X86
+/*
+ * Each iteration widens 16 bytes of two taps to 16 bit, interleaves them and
+ * lets pmaddwd multiply and add both taps at once into 32 bit accumulators.
+ *
+ */
+__attribute__((target("sse2"))) static void convolve_sse2(
+    uint8_t *dst, const uint8_t **src, const kernel_t *kernel, int len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(WEIGHT_ONE / 2);
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for (int k = 0; k < kernel->taps; k += 2) {
+            const __m128i w = _mm_set1_epi32(kernel->pairs[k / 2]);
+            const __m128i a = _mm_loadu_si128((const __m128i *)(src[k] + i));
+            const __m128i b =
+                _mm_loadu_si128((const __m128i *)(src[k + 1] + i));
+            const __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+            const __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+            const __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+            const __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+            acc0 = _mm_add_epi32(
+                acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), w));
+            acc1 = _mm_add_epi32(
+                acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), w));
+            acc2 = _mm_add_epi32(
+                acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), w));
+            acc3 = _mm_add_epi32(
+                acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), w));
+        }
+        const __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc0, WEIGHT_BITS),
+                                           _mm_srai_epi32(acc1, WEIGHT_BITS));
+        const __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc2, WEIGHT_BITS),
+                                           _mm_srai_epi32(acc3, WEIGHT_BITS));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+
+    convolve_range(dst, src, kernel, i, len);
+}
+
+/*
+ * Same as convolve_sse2, on 32 bytes at a time. All unpack and pack
+ * instructions operate within 128 bit lanes, so the byte order is preserved.
+ *
+ */
+__attribute__((target("avx2"))) static void convolve_avx2(
+    uint8_t *dst, const uint8_t **src, const kernel_t *kernel, int len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(WEIGHT_ONE / 2);
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+        for (int k = 0; k < kernel->taps; k += 2) {
+            const __m256i w = _mm256_set1_epi32(kernel->pairs[k / 2]);
+            const __m256i a =
+                _mm256_loadu_si256((const __m256i *)(src[k] + i));
+            const __m256i b =
+                _mm256_loadu_si256((const __m256i *)(src[k + 1] + i));
+            const __m256i a_lo = _mm256_unpacklo_epi8(a, zero);
+            const __m256i a_hi = _mm256_unpackhi_epi8(a, zero);
+            const __m256i b_lo = _mm256_unpacklo_epi8(b, zero);
+            const __m256i b_hi = _mm256_unpackhi_epi8(b, zero);
+            acc0 = _mm256_add_epi32(
+                acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_lo, b_lo), w));
+            acc1 = _mm256_add_epi32(
+                acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_lo, b_lo), w));
+            acc2 = _mm256_add_epi32(
+                acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(a_hi, b_hi), w));
+            acc3 = _mm256_add_epi32(
+                acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(a_hi, b_hi), w));
+        }
+        const __m256i lo =
+            _mm256_packs_epi32(_mm256_srai_epi32(acc0, WEIGHT_BITS),
+                               _mm256_srai_epi32(acc1, WEIGHT_BITS));
+        const __m256i hi =
+            _mm256_packs_epi32(_mm256_srai_epi32(acc2, WEIGHT_BITS),
+                               _mm256_srai_epi32(acc3, WEIGHT_BITS));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    convolve_range(dst, src, kernel, i, len);
+}
+#endif
+
+static convolve_fn_t convolve = NULL;
+
+static void select_convolve(void) {
+#ifdef BLUR_CPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        DEBUG("CPU blur: using AVX2\n");
+        convolve = convolve_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        DEBUG("CPU blur: using SSE2\n");
+        convolve = convolve_sse2;
+        return;
+    }
+#endif
+    DEBUG("CPU blur: using scalar code\n");
+    convolve = convolve_scalar;
+}
+
+/*******************************************************************************
+ * Thread pool
+ ******************************************************************************/
+
+typedef void (*row_fn_t)(void *ctx, int row, int thread);
+
+static struct {
+    /* The process which started the workers. Threads do not survive fork(),
+     * so a child process (i3lock forks after mapping its window) has to start
+     * its own. */
+    pid_t pid;
+    /* Number of worker threads. The thread calling parallel_for() takes part,
+     * too, and uses the thread index nthreads. */
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t work_done;
+    unsigned int generation;
+    int busy;
+
+    row_fn_t fn;
+    void *ctx;
+    int rows;
+    int next_row;
+} pool;
+
+static void pool_run(int thread) {
+    int row;
+    while ((row = __atomic_fetch_add(&pool.next_row, ROWS_PER_CHUNK,
+                                     __ATOMIC_RELAXED)) < pool.rows) {
+        const int end =
+            (row + ROWS_PER_CHUNK < pool.rows ? row + ROWS_PER_CHUNK
+                                              : pool.rows);
+        for (; row < end; row++) {
+            pool.fn(pool.ctx, row, thread);
+        }
+    }
+}
+
+static void *pool_worker(void *arg) {
+    const int thread = (intptr_t)arg;
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == seen) {
+            pthread_cond_wait(&pool.work_available, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool_run(thread);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0) {
+            pthread_cond_signal(&pool.work_done);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts one worker per online CPU (minus the calling thread), unless this
+ * process already did so. Returns the number of threads taking part in
+ * parallel_for().
+ *
+ */
+static int pool_init(void) {
+    if (pool.pid == getpid()) {
+        return pool.nthreads + 1;
+    }
+
+    pool.pid = getpid();
+    pool.nthreads = 0;
+    pool.generation = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_available, NULL);
+    pthread_cond_init(&pool.work_done, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) {
+        cpus = 1;
+    } else if (cpus > MAX_THREADS) {
+        cpus = MAX_THREADS;
+    }
+
+    for (int i = 0; i < cpus - 1; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void *)(intptr_t)i) !=
+            0) {
+            warn("Could not start blur thread");
+            break;
+        }
+        pthread_detach(thread);
+        pool.nthreads++;
+    }
+
+    DEBUG("CPU blur: %d threads\n", pool.nthreads + 1);
+    return pool.nthreads + 1;
+}
+
+/*
+ * Calls fn(ctx, row, thread) for every row in [0, rows) and returns once all
+ * rows are done. thread is in [0, pool_init()).
+ *
+ */
+static void parallel_for(int rows, row_fn_t fn, void *ctx) {
+    pool_init();
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.rows = rows;
+    pool.next_row = 0;
+    pool.busy = pool.nthreads;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work_available);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_run(pool.nthreads);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0) {
+        pthread_cond_wait(&pool.work_done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/*******************************************************************************
+ * Blur
+ ******************************************************************************/
+
+typedef struct {
+    uint8_t *data;
+    int width;
+    int height;
+    int stride;
+    int radius;
+    const kernel_t *kernel;
+    /* The horizontally blurred image, width * 4 bytes per row. */
+    uint8_t *tmp;
+    /* Per thread: one row with radius pixels of edge padding on either side,
+     * and the source pointers for each tap. */
+    uint8_t *pad;
+    size_t pad_stride;
+    const uint8_t **src;
+} blur_job_t;
+
+/* Buffers are kept around between calls, live mode blurs every frame. */
+static uint8_t *tmp_buffer = NULL;
+static size_t tmp_buffer_size = 0;
+static uint8_t *pad_buffer = NULL;
+static size_t pad_buffer_size = 0;
+
+static void *reserve(uint8_t **buffer, size_t *size, size_t needed) {
+    if (*size < needed) {
+        free(*buffer);
+        if ((*buffer = malloc(needed)) == NULL) {
+            *size = 0;
+            return NULL;
+        }
+        *size = needed;
+    }
+    return *buffer;
+}
+
+static void blur_row_horizontal(void *ctx, int y, int thread) {
+    const blur_job_t *job = ctx;
+    const int r = job->radius;
+    const int w = job->width;
+    const uint8_t *row = job->data + (size_t)y * job->stride;
+    uint8_t *pad = job->pad + thread * job->pad_stride;
+    const uint8_t **src = job->src + thread * job->kernel->taps;
+
+    /* Replicate the edge pixels, like GL_CLAMP_TO_EDGE does. */
+    for (int x = 0; x < r; x++) {
+        memcpy(pad + x * 4, row, 4);
+        memcpy(pad + (r + w + x) * 4, row + (w - 1) * 4, 4);
+    }
+    memcpy(pad + r * 4, row, w * 4);
+
+    for (int k = 0; k < job->kernel->taps; k++) {
+        /* The last tap only pads the kernel to an even length. */
+        src[k] = pad + (k < 2 * r ? k : 2 * r) * 4;
+    }
+    convolve(job->tmp + (size_t)y * w * 4, src, job->kernel, w * 4);
+}
+
+static void blur_row_vertical(void *ctx, int y, int thread) {
+    const blur_job_t *job = ctx;
+    const int r = job->radius;
+    const uint8_t **src = job->src + thread * job->kernel->taps;
+
+    for (int k = 0; k < job->kernel->taps; k++) {
+        int source_row = y + (k < 2 * r ? k : 2 * r) - r;
+        if (source_row < 0) {
+            source_row = 0;
+        } else if (source_row >= job->height) {
+            source_row = job->height - 1;
+        }
+        src[k] = job->tmp + (size_t)source_row * job->width * 4;
+    }
+    convolve(job->data + (size_t)y * job->stride, src, job->kernel,
+             job->width * 4);
+}
+
+/*
+ * Blurs a 32 bits per pixel image in place with the same gaussian kernel the
+ * GLX backend uses.
+ *
+ */
+void blur_buffer_cpu(uint8_t *data, int width, int height, int stride,
+                     int radius, float sigma) {
+    if (radius < 1 || width < 1 || height < 1) {
+        return;
+    }
+
+    if (convolve == NULL) {
+        select_convolve();
+    }
+    const int threads = pool_init();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Convert the weights to fixed point, making sure that they add up to
+     * exactly one so that flat areas keep their color. */
+    float *weights = generate_gaussian_weights(radius, sigma);
+    kernel_t kernel;
+    kernel.taps = 2 * radius + 2;
+    kernel.weights = calloc(kernel.taps, sizeof(int16_t));
+    kernel.pairs = calloc(kernel.taps / 2, sizeof(int32_t));
+    blur_job_t job = {
+        .data = data,
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .radius = radius,
+        .kernel = &kernel,
+        .pad_stride = (size_t)(width + 2 * radius) * 4,
+        .src = calloc((size_t)threads * kernel.taps, sizeof(uint8_t *)),
+    };
+    job.tmp = reserve(&tmp_buffer, &tmp_buffer_size, (size_t)width * height * 4);
+    job.pad = reserve(&pad_buffer, &pad_buffer_size, threads * job.pad_stride);
+    if (weights == NULL || kernel.weights == NULL || kernel.pairs == NULL ||
+        job.src == NULL || job.tmp == NULL || job.pad == NULL) {
+        warnx("Could not allocate memory for the blur.");
+        goto out;
+    }
+
+    int sum = 0;
+    for (int k = 0; k <= 2 * radius; k++) {
+        kernel.weights[k] = lrintf(weights[abs(k - radius)] * WEIGHT_ONE);
+        sum += kernel.weights[k];
+    }
+    kernel.weights[radius] += WEIGHT_ONE - sum;
+    for (int k = 0; k < kernel.taps; k += 2) {
+        kernel.pairs[k / 2] = (uint16_t)kernel.weights[k] |
+                              ((uint32_t)(uint16_t)kernel.weights[k + 1] << 16);
+    }
+
+    parallel_for(height, blur_row_horizontal, &job);
+    parallel_for(height, blur_row_vertical, &job);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    DEBUG("CPU blur of %dx%d, radius %d: %.2f ms\n", width, height, radius,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6);
+
+out:
+    free(weights);
+    free(kernel.weights);
+    free(kernel.pairs);
+    free(job.src);
+}
+
+/*******************************************************************************
+ * Pyramid
+ ******************************************************************************/
+
+typedef struct {
+    const uint8_t *src;
+    int src_width;
+    int src_height;
+    int src_stride;
+    uint8_t *dst;
+    int dst_width;
+    int dst_stride;
+    /* Per thread: one source row of widened pixels, see widen(). */
+    uint64_t *scratch;
+} resample_job_t;
+
+static uint8_t *level_buffers[MAX_PYRAMID_LEVELS + 1];
+static size_t level_buffer_sizes[MAX_PYRAMID_LEVELS + 1];
+static uint8_t *scratch_buffer = NULL;
+static size_t scratch_buffer_size = 0;
+
+#define LANE_MASK 0x00ff00ff00ff00ffULL
+#define LANE_ONES 0x0001000100010001ULL
+
+/* Spreads the four channels of a pixel over 16 bit lanes, so that sums of up
+ * to 256 pixels can be computed for all channels at once. */
+static inline uint64_t widen(const uint8_t *pixel) {
+    uint32_t p;
+    memcpy(&p, pixel, sizeof(p));
+    return (p & 0x00ff00ffULL) | ((uint64_t)((p >> 8) & 0x00ff00ff) << 32);
+}
+
+static inline void narrow(uint8_t *pixel, uint64_t lanes) {
+    lanes &= LANE_MASK;
+    const uint32_t p = (uint32_t)(lanes | (lanes >> 24));
+    memcpy(pixel, &p, sizeof(p));
+}
+
+/* Halves the resolution by averaging each 2x2 block, the last row and column
+ * are repeated for odd sizes. */
+static void downsample_row(void *ctx, int y, int thread) {
+    const resample_job_t *job = ctx;
+    const uint8_t *row0 = job->src + (size_t)(2 * y) * job->src_stride;
+    const uint8_t *row1 =
+        (2 * y + 1 < job->src_height) ? row0 + job->src_stride : row0;
+    uint8_t *out = job->dst + (size_t)y * job->dst_stride;
+
+    for (int x = 0; x < job->dst_width; x++) {
+        const int x0 = 2 * x * 4;
+        const int x1 = (2 * x + 1 < job->src_width) ? x0 + 4 : x0;
+        const uint64_t sum = widen(row0 + x0) + widen(row0 + x1) +
+                             widen(row1 + x0) + widen(row1 + x1);
+        narrow(out + x * 4, (sum + 2 * LANE_ONES) >> 2);
+    }
+}
+
+/* Doubles the resolution with bilinear filtering. Every output pixel lies a
+ * quarter pixel away from its nearest source pixel in both directions, so the
+ * weights of the four surrounding source pixels are 9, 3, 3 and 1 sixteenths,
+ * which is what the GL backend gets from the texture unit. The vertical 3:1
+ * blend is done first, into the thread's scratch row. */
+static void upsample_row(void *ctx, int y, int thread) {
+    const resample_job_t *job = ctx;
+    const int sy = y / 2;
+    int ny = (y % 2) ? sy + 1 : sy - 1;
+    ny = ny < 0 ? 0 : (ny >= job->src_height ? job->src_height - 1 : ny);
+    const uint8_t *near = job->src + (size_t)sy * job->src_stride;
+    const uint8_t *far = job->src + (size_t)ny * job->src_stride;
+    uint8_t *out = job->dst + (size_t)y * job->dst_stride;
+
+    /* The edge pixels are repeated, so that the loop below needs no
+     * clamping. */
+    const int n = job->src_width;
+    uint64_t *v = job->scratch + (size_t)thread * (n + 2) + 1;
+    for (int x = 0; x < n; x++) {
+        v[x] = 3 * widen(near + x * 4) + widen(far + x * 4);
+    }
+    v[-1] = v[0];
+    v[n] = v[n - 1];
+
+    const uint64_t round = 8 * LANE_ONES;
+    for (int sx = 0; sx < job->dst_width / 2; sx++) {
+        const uint64_t center = 3 * v[sx] + round;
+        narrow(out + sx * 8, (center + v[sx - 1]) >> 4);
+        narrow(out + sx * 8 + 4, (center + v[sx + 1]) >> 4);
+    }
+    if (job->dst_width % 2) {
+        const int sx = job->dst_width / 2;
+        narrow(out + sx * 8, (3 * v[sx] + round + v[sx - 1]) >> 4);
+    }
+}
+
+/*
+ * Approximates blur_buffer_cpu() by blurring a downsampled copy of the image
+ * with a smaller kernel, as planned by plan_pyramid_blur(). The cost of the
+ * gaussian drops by 4^levels, at the price of a slightly softer result.
+ *
+ */
+void blur_pyramid_cpu(uint8_t *data, int width, int height, int stride,
+                      int levels, int level_radius, float level_sigma) {
+    const int threads = pool_init();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t *scratch = reserve(&scratch_buffer, &scratch_buffer_size,
+                                (size_t)threads * (width + 2) * 8);
+    if (scratch == NULL) {
+        warnx("Could not allocate memory for the blur.");
+        return;
+    }
+
+    uint8_t *buffer[MAX_PYRAMID_LEVELS + 1] = {data};
+    int widths[MAX_PYRAMID_LEVELS + 1] = {width};
+    int heights[MAX_PYRAMID_LEVELS + 1] = {height};
+    int strides[MAX_PYRAMID_LEVELS + 1] = {stride};
+    for (int i = 1; i <= levels; i++) {
+        widths[i] = (widths[i - 1] + 1) / 2;
+        heights[i] = (heights[i - 1] + 1) / 2;
+        strides[i] = widths[i] * 4;
+        buffer[i] = reserve(&level_buffers[i], &level_buffer_sizes[i],
+                            (size_t)strides[i] * heights[i]);
+        if (buffer[i] == NULL) {
+            warnx("Could not allocate memory for the blur.");
+            return;
+        }
+    }
+
+    for (int i = 1; i <= levels; i++) {
+        resample_job_t job = {
+            .src = buffer[i - 1],
+            .src_width = widths[i - 1],
+            .src_height = heights[i - 1],
+            .src_stride = strides[i - 1],
+            .dst = buffer[i],
+            .dst_width = widths[i],
+            .dst_stride = strides[i],
+        };
+        parallel_for(heights[i], downsample_row, &job);
+    }
+
+    blur_buffer_cpu(buffer[levels], widths[levels], heights[levels],
+                    strides[levels], level_radius, level_sigma);
+
+    for (int i = levels - 1; i >= 0; i--) {
+        resample_job_t job = {
+            .src = buffer[i + 1],
+            .src_width = widths[i + 1],
+            .src_height = heights[i + 1],
+            .src_stride = strides[i + 1],
+            .dst = buffer[i],
+            .dst_width = widths[i],
+            .dst_stride = strides[i],
+            .scratch = scratch,
+        };
+        parallel_for(heights[i], upsample_row, &job);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    DEBUG("CPU pyramid blur of %dx%d, %d levels, radius %d: %.2f ms\n", width,
+          height, levels, level_radius,
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+/* If the X server runs on this machine, the screen is read back and uploaded
+ * through a MIT-SHM segment instead of being copied through the socket. The
+ * segment is sized for the whole screen, smaller areas use the start of it. */
+static xcb_shm_seg_t shm_seg;
+static uint8_t *shm_data = NULL;
+static size_t shm_size = 0;
+static bool shm_unavailable = false;
+
+static void shm_free(void) {
+    if (shm_data == NULL) {
+        return;
+    }
+    xcb_shm_detach(conn, shm_seg);
+    shmdt(shm_data);
+    shm_data = NULL;
+    shm_size = 0;
+}
+
+/*
+ * Makes sure that the shared memory segment holds at least size bytes.
+ * Returns false if MIT-SHM cannot be used, e.g. with a remote X server, in
+ * which case the caller should use XGetImage() and XPutImage().
+ *
+ */
+static bool shm_reserve(size_t size) {
+    if (shm_unavailable) {
+        return false;
+    }
+    if (shm_size >= size) {
+        return true;
+    }
+    shm_free();
+
+    const xcb_query_extension_reply_t *extension =
+        xcb_get_extension_data(conn, &xcb_shm_id);
+    if (extension == NULL || !extension->present) {
+        DEBUG("MIT-SHM is not available.\n");
+        shm_unavailable = true;
+        return false;
+    }
+
+    const int id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (id == -1) {
+        warn("Could not create a shared memory segment of %zu bytes", size);
+        shm_unavailable = true;
+        return false;
+    }
+    void *data = shmat(id, NULL, 0);
+    xcb_generic_error_t *error = NULL;
+    if (data != (void *)-1) {
+        shm_seg = xcb_generate_id(conn);
+        error = xcb_request_check(
+            conn, xcb_shm_attach_checked(conn, shm_seg, id, false));
+    }
+    /* The segment is only freed once both sides detached from it. */
+    shmctl(id, IPC_RMID, NULL);
+
+    if (data == (void *)-1 || error != NULL) {
+        /* The X server cannot attach segments of other machines. */
+        DEBUG("Could not share memory with the X server.\n");
+        if (data != (void *)-1) {
+            shmdt(data);
+        }
+        free(error);
+        shm_unavailable = true;
+        return false;
+    }
+    shm_data = data;
+    shm_size = size;
+    return true;
+}
+
+/*
+ * Reads the given part of src into the shared memory segment, with a stride
+ * of 4 * w bytes. Sets *depth to the depth of src, which is needed for
+ * uploading the pixels again.
+ *
+ */
+static bool shm_get_image(Pixmap src, int x, int y, int w, int h,
+                          uint8_t *depth) {
+    xcb_shm_get_image_reply_t *reply = xcb_shm_get_image_reply(
+        conn,
+        xcb_shm_get_image(conn, src, x, y, w, h, ~0,
+                          XCB_IMAGE_FORMAT_Z_PIXMAP, shm_seg, 0),
+        NULL);
+    if (reply == NULL) {
+        return false;
+    }
+    /* Other pixel formats are left to XGetImage(), which reports them. */
+    const bool ok = reply->size == (uint32_t)w * h * 4;
+    *depth = reply->depth;
+    free(reply);
+    if (!ok) {
+        shm_free();
+        shm_unavailable = true;
+    }
+    return ok;
+}
+
+/*
+ * Blurs the given area of src into dst by reading the area and the pixels
+ * around it which the blur depends on back from the X server, blurring them
+ * on the CPU and uploading the area again. src and dst may be the same pixmap.
+ *
+ */
+void blur_image_cpu(Pixmap src, Pixmap dst, int width, int height,
+                    XRectangle area, int radius, float sigma) {
+    int levels = 0, level_radius;
+    float level_sigma;
+    if (blur_method == BLUR_METHOD_PYRAMID) {
+        /* The plan depends on the screen size, not on the size of the area. */
+        plan_pyramid_blur(radius, sigma, width, height, &levels, &level_radius,
+                          &level_sigma);
+    }
+
+    /* For the pyramid, the read back region starts on a pixel of the
+     * smallest level, so that the levels line up with those of a blur of the
+     * whole screen. */
+    const int align = 1 << levels;
+    const int reach = blur_reach(radius, sigma, width, height);
+    const int x0 = MAX(area.x - reach, 0) / align * align;
+    const int y0 = MAX(area.y - reach, 0) / align * align;
+    const int x1 = MIN(area.x + area.width + reach, width);
+    const int y1 = MIN(area.y + area.height + reach, height);
+
+    struct timespec start, fetched, blurred, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    XImage *image = NULL;
+    uint8_t *data, depth;
+    int stride;
+    const bool shared = shm_reserve((size_t)width * height * 4) &&
+                        shm_get_image(src, x0, y0, x1 - x0, y1 - y0, &depth);
+    if (shared) {
+        data = shm_data;
+        stride = (x1 - x0) * 4;
+    } else {
+        image = XGetImage(display, src, x0, y0, x1 - x0, y1 - y0, AllPlanes,
+                          ZPixmap);
+        if (image == NULL) {
+            warnx("Could not read the screen contents for blurring.");
+            return;
+        }
+        if (image->bits_per_pixel != 32) {
+            warnx("CPU blur only supports 32 bits per pixel, not %d.",
+                  image->bits_per_pixel);
+            XDestroyImage(image);
+            return;
+        }
+        data = (uint8_t *)image->data;
+        stride = image->bytes_per_line;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &fetched);
+
+    if (levels > 0) {
+        blur_pyramid_cpu(data, x1 - x0, y1 - y0, stride, levels, level_radius,
+                         level_sigma);
+    } else {
+        blur_buffer_cpu(data, x1 - x0, y1 - y0, stride, radius, sigma);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &blurred);
+
+    if (shared) {
+        /* The next shm_get_image() waits for a reply, so the X server is done
+         * reading the segment before it is written again. */
+        xcb_gcontext_t gc = xcb_generate_id(conn);
+        xcb_create_gc(conn, gc, dst, 0, NULL);
+        xcb_shm_put_image(conn, dst, gc, x1 - x0, y1 - y0, area.x - x0,
+                          area.y - y0, area.width, area.height, area.x,
+                          area.y, depth, XCB_IMAGE_FORMAT_Z_PIXMAP, false,
+                          shm_seg, 0);
+        xcb_free_gc(conn, gc);
+        xcb_flush(conn);
+    } else {
+        GC gc = XCreateGC(display, dst, 0, NULL);
+        XPutImage(display, dst, gc, image, area.x - x0, area.y - y0, area.x,
+                  area.y, area.width, area.height);
+        XFreeGC(display, gc);
+        XDestroyImage(image);
+    }
+    if (area.width == width && area.height == height) {
+        full_screen_copies++;
+    }
+
+    if (debug_mode) {
+        /* Only wait for the upload when measuring it. */
+        XSync(display, False);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        DEBUG("CPU blur of %dx%d: %.2f ms reading, %.2f ms blurring, %.2f ms "
+              "writing through %s\n",
+              x1 - x0, y1 - y0,
+              (fetched.tv_sec - start.tv_sec) * 1e3 +
+                  (fetched.tv_nsec - start.tv_nsec) / 1e6,
+              (blurred.tv_sec - fetched.tv_sec) * 1e3 +
+                  (blurred.tv_nsec - fetched.tv_nsec) / 1e6,
+              (end.tv_sec - blurred.tv_sec) * 1e3 +
+                  (end.tv_nsec - blurred.tv_nsec) / 1e6,
+              shared ? "MIT-SHM" : "the socket");
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * dpms.c: Keeps track of whether DPMS turned the monitors off, so that
+ *         redrawing the screen does not need to ask the X server first. With
+ *         DPMS 1.2 and libxcb 1.15 or newer the X server reports changes
+ *         with InfoNotify events, otherwise the state is polled from a
+ *         timer.
+ *
+ */
+#include <ev.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <xcb/dpms.h>
+#include <xcb/xcb.h>
+
+#include "dpms.h"
+#include "i3lock.h"
+
+extern bool debug_mode;
+
+/* How often the state is polled if the X server does not report it. */
+#define POLL_INTERVAL 0.5
+
+static xcb_connection_t *connection;
+static void (*changed_cb)(bool monitor_off);
+static bool monitor_off = false;
+/* The major opcode of DPMS if InfoNotify events are selected, 0 otherwise. */
+static uint8_t dpms_opcode = 0;
+static struct ev_timer *poll_timer;
+
+/*
+ * Updates the cached state, calling the callback if it changed.
+ *
+ */
+static void set_state(bool enabled, uint16_t power_level) {
+    /* The monitor is off when DPMS is enabled and the power level is not
+     * DPMS_MODE_ON. */
+    const bool off = enabled && power_level != XCB_DPMS_DPMS_MODE_ON;
+    if (off == monitor_off) {
+        return;
+    }
+    monitor_off = off;
+    DEBUG("dpms: monitor %s\n", off ? "off" : "on");
+    if (changed_cb != NULL) {
+        changed_cb(off);
+    }
+}
+
+static void query_state(void) {
+    xcb_dpms_info_reply_t *info =
+        xcb_dpms_info_reply(connection, xcb_dpms_info(connection), NULL);
+    if (info) {
+        set_state(info->state, info->power_level);
+        free(info);
+    }
+}
+
+static void poll_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    query_state();
+}
+
+/*
+ * Reads the current state and starts following it. changed is called
+ * whenever the monitors are turned off or on afterwards.
+ *
+ */
+void dpms_init(xcb_connection_t *conn, struct ev_loop *loop,
+               void (*changed)(bool monitor_off)) {
+    connection = conn;
+
+    /* check if the X server supports DPMS */
+    xcb_dpms_capable_reply_t *capable =
+        xcb_dpms_capable_reply(conn, xcb_dpms_capable(conn), NULL);
+    const bool dpms_capable = capable != NULL && capable->capable;
+    free(capable);
+    if (!dpms_capable) {
+        DEBUG("dpms: not supported\n");
+        return;
+    }
+
+#ifdef XCB_DPMS_INFO_NOTIFY
+    xcb_dpms_get_version_reply_t *version =
+        xcb_dpms_get_version_reply(conn, xcb_dpms_get_version(conn, 1, 2),
+                                   NULL);
+    const bool has_events =
+        version != NULL && (version->server_major_version > 1 ||
+                            (version->server_major_version == 1 &&
+                             version->server_minor_version >= 2));
+    free(version);
+
+    if (has_events) {
+        dpms_opcode = xcb_get_extension_data(conn, &xcb_dpms_id)->major_opcode;
+        xcb_dpms_select_input(conn, XCB_DPMS_EVENT_MASK_INFO_NOTIFY);
+    }
+#else
+    /* libxcb before 1.15 does not know about InfoNotify. */
+    const bool has_events = false;
+#endif
+    /* Selected before the query, so no change is missed. If the monitors are
+     * off already, the callback is called right away. */
+    changed_cb = changed;
+    query_state();
+
+    if (!has_events) {
+        DEBUG("dpms: no InfoNotify, polling every %.1f s\n", POLL_INTERVAL);
+        poll_timer = calloc(1, sizeof(struct ev_timer));
+        ev_timer_init(poll_timer, poll_cb, POLL_INTERVAL, POLL_INTERVAL);
+        ev_timer_start(loop, poll_timer);
+    }
+}
+
+bool dpms_monitor_off(void) {
+    return monitor_off;
+}
+
+/*
+ * Handles InfoNotify. Returns true if event was such an event.
+ *
+ */
+bool dpms_handle_event(const xcb_generic_event_t *event) {
+#ifdef XCB_DPMS_INFO_NOTIFY
+    if (dpms_opcode == 0 || event->response_type != XCB_GE_GENERIC) {
+        return false;
+    }
+    const xcb_dpms_info_notify_event_t *ev =
+        (const xcb_dpms_info_notify_event_t *)event;
+    if (ev->extension != dpms_opcode ||
+        ev->event_type != XCB_DPMS_INFO_NOTIFY) {
+        return false;
+    }
+    set_state(ev->state, ev->power_level);
+    return true;
+#else
+    return false;
+#endif
+}
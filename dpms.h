@@ -0,0 +1,13 @@
+#ifndef _DPMS_H
+#define _DPMS_H
+
+#include <ev.h>
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+void dpms_init(xcb_connection_t *conn, struct ev_loop *loop,
+               void (*changed)(bool monitor_off));
+bool dpms_monitor_off(void);
+bool dpms_handle_event(const xcb_generic_event_t *event);
+
+#endif
@@ -11,10 +11,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pwd.h>
+#include <signal.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <xcb/damage.h>
 #include <xcb/dpms.h>
@@ -46,8 +49,12 @@
 
 #include "blur.h"
 #include "cursors.h"
+#include "dpms.h"
 #include "i3lock.h"
+#include "present.h"
+#include "render.h"
 #include "unlock_indicator.h"
+#include "window_table.h"
 #include "xcb.h"
 #include "randr.h"
 
@@ -60,6 +67,7 @@
 typedef void (*ev_callback_t)(EV_P_ ev_timer *w, int revents);
 static void input_done(void);
 static void maybe_close_sleep_lock_fd(void);
+static void unlock_screen(void);
 
 /* We need this for libxkbfile */
 Display *display;
@@ -67,22 +75,63 @@ char color[7] = "ffffff";
 uint32_t last_resolution[2];
 xcb_window_t win;
 static xcb_cursor_t cursor;
+static int curs_choice = CURS_NONE;
+/* The window which had the focus before locking, if any. */
+static xcb_window_t stolen_focus = XCB_NONE;
 #ifndef __OpenBSD__
+static char *username;
 static pam_handle_t *pam_handle;
 #endif
 int input_position = 0;
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
+/* The password which is being verified. It is moved out of password, so that
+ * typing can go on while the authentication runs in auth_thread. */
+static char auth_password[512];
+static pthread_t auth_thread;
+static bool auth_succeeded;
+/* Signalled by auth_thread when it is done. */
+static struct ev_async *auth_done;
 static bool beep = false;
 bool debug_mode = false;
-bool dpms_capable = false;
 bool unlock_indicator = true;
 char *modifier_string = NULL;
 static bool dont_fork = false;
+/* In daemon mode, i3lock keeps running after unlocking and locks the screen
+ * again on SIGUSR1, without connecting to X11 or loading the image anew. */
+static bool daemon_mode = false;
+/* Whether the lock window is open, always true unless in daemon mode. */
+static bool screen_locked = false;
+/* The screen is locked once the lock window is mapped, the pointer and
+ * keyboard are grabbed and the first frame is shown, see check_locked(). */
+static bool window_mapped = false;
+static bool input_grabbed = false;
+static bool frame_shown = false;
+/* Whether check_locked() reported the current lock already. */
+static bool lock_reported = false;
+static ev_tstamp lock_start;
+/* Where to report that the screen is locked, -1 if nowhere. */
+static int ready_fd = -1;
 struct ev_loop *main_loop;
 static struct ev_timer *clear_auth_wrong_timeout;
 static struct ev_timer *clear_indicator_timeout;
 static struct ev_timer *discard_passwd_timeout;
+/* Pending redraw of damaged parts of the screen in live fuzzy mode. */
+static struct ev_timer *damage_redraw_timeout;
+/* Counts the first frame of a lock as shown if Present does not report it as
+ * complete in time, as present_busy() does for later frames. */
+static struct ev_timer *first_frame_timeout;
+static struct ev_timer *lock_failed_timeout;
+static ev_tstamp last_damage_redraw = 0;
+static int damage_events = 0;
+/* While DPMS has the monitors off, live fuzzy mode releases its damage
+ * objects, so that changes behind the lock screen no longer wake it up. */
+static bool damage_suspended = false;
+/* How often the event loop woke up since the monitors were turned off. */
+static int blanked_wakeups = 0;
+static ev_tstamp blanked_since;
+/* Upper bound on the redraws per second caused by damage, 0 for no limit. */
+static double max_fps = 30;
 extern unlock_state_t unlock_state;
 extern auth_state_t auth_state;
 int failed_attempts = 0;
@@ -101,11 +150,21 @@ static int randr_base = -1;
 const xcb_query_extension_reply_t *dam_ext_data;
 
 cairo_surface_t *img = NULL;
+/* The pixmap behind img in once fuzzy mode. */
+static xcb_pixmap_t once_pixmap = XCB_NONE;
 bool tile = false;
 bool fuzzy = false;
 bool once = false;
 int blur_radius = 0;
 float blur_sigma = 0;
+/* Whether blur_radius and blur_sigma follow the screen height because they
+ * were not given on the command line. */
+static bool blur_scaled = false;
+blur_backend_t blur_backend = BLUR_BACKEND_GL;
+blur_method_t blur_method = BLUR_METHOD_GAUSSIAN;
+/* Full-screen copies into the background pixmap for the current frame, only
+ * used for the debug output of redraw_screen(). */
+int full_screen_copies = 0;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
@@ -184,20 +243,20 @@ static bool load_compose_table(const char *locale) {
 }
 
 /*
- * Clears the memory which stored the password to be a bit safer against
+ * Clears the memory which stored a password to be a bit safer against
  * cold-boot attacks.
  *
  */
-static void clear_password_memory(void) {
+static void clear_password_memory(char *buffer, size_t size) {
 #ifdef __OpenBSD__
     /* Use explicit_bzero(3) which was explicitly designed not to be
      * optimized out by the compiler. */
-    explicit_bzero(password, strlen(password));
+    explicit_bzero(buffer, size);
 #else
     /* A volatile pointer to the password buffer to prevent the compiler from
      * optimizing this out. */
-    volatile char *vpassword = password;
-    for (size_t c = 0; c < sizeof(password); c++)
+    volatile char *vpassword = buffer;
+    for (size_t c = 0; c < size; c++)
         /* We store a non-random pattern which consists of the (irrelevant)
          * index plus (!) the value of the beep variable. This prevents the
          * compiler from optimizing the calls away, since the value of 'beep'
@@ -276,7 +335,7 @@ static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
 
 static void clear_input(void) {
     input_position = 0;
-    clear_password_memory();
+    clear_password_memory(password, sizeof(password));
     password[input_position] = '\0';
 }
 
@@ -285,30 +344,22 @@ static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_auth_wrong_timeout);
-    auth_state = STATE_AUTH_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_unlock_indicator();
-
+/*
+ * Verifies auth_password, then clears it. This runs in auth_thread, so it must
+ * not touch anything but the authentication backend.
+ *
+ */
+static void authenticate(void) {
 #ifdef __OpenBSD__
     struct passwd *pw;
 
     if (!(pw = getpwuid(getuid())))
         errx(1, "unknown uid %u.", getuid());
 
-    if (auth_userokay(pw->pw_name, NULL, NULL, password) != 0) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
-
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
-        return;
-    }
+    auth_succeeded = (auth_userokay(pw->pw_name, NULL, NULL, auth_password) != 0);
 #else
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
-
+    auth_succeeded = (pam_authenticate(pam_handle, 0) == PAM_SUCCESS);
+    if (auth_succeeded) {
         /* PAM credentials should be refreshed, this will for example update any
          * kerberos tickets.
          * Related to credentials pam_end() needs to be called to cleanup any
@@ -318,11 +369,66 @@ static void input_done(void) {
          * refresh of the credentials failed. */
         pam_setcred(pam_handle, PAM_REFRESH_CRED);
         pam_end(pam_handle, PAM_SUCCESS);
+        pam_handle = NULL;
+    }
+#endif
+    clear_password_memory(auth_password, sizeof(auth_password));
+}
+
+static void *auth_thread_main(void *arg) {
+    authenticate();
+    ev_async_send(main_loop, auth_done);
+    return NULL;
+}
+
+static void auth_finished(void);
 
-        ev_break(EV_DEFAULT, EVBREAK_ALL);
+static void auth_done_cb(EV_P_ ev_async *w, int revents) {
+    /* Also makes auth_succeeded visible to this thread. */
+    pthread_join(auth_thread, NULL);
+    auth_finished();
+}
+
+/*
+ * Starts verifying the entered password. The event loop keeps running in the
+ * meantime, so the unlock indicator and the blurred screen stay up to date
+ * even if the authentication backend takes seconds.
+ *
+ */
+static void input_done(void) {
+    STOP_TIMER(clear_auth_wrong_timeout);
+    auth_state = STATE_AUTH_VERIFY;
+    unlock_state = STATE_STARTED;
+    redraw_unlock_indicator();
+
+    /* Keys pressed from now on go into an empty password buffer. */
+    memcpy(auth_password, password, sizeof(password));
+    clear_input();
+
+    const int ret = pthread_create(&auth_thread, NULL, auth_thread_main, NULL);
+    if (ret != 0) {
+        /* Better to block than to not be able to unlock. */
+        warnx("Could not start the authentication thread: %s", strerror(ret));
+        authenticate();
+        auth_finished();
+    }
+}
+
+/*
+ * Unlocks after a successful authentication, or shows that the password was
+ * wrong.
+ *
+ */
+static void auth_finished(void) {
+    if (auth_succeeded) {
+        DEBUG("successfully authenticated\n");
+        if (daemon_mode) {
+            unlock_screen();
+        } else {
+            ev_break(EV_DEFAULT, EVBREAK_ALL);
+        }
         return;
     }
-#endif
 
     if (debug_mode)
         fprintf(stderr, "Authentication failure\n");
@@ -365,7 +471,6 @@ static void input_done(void) {
 
     auth_state = STATE_AUTH_WRONG;
     failed_attempts += 1;
-    clear_input();
 
     if (unlock_indicator)
         redraw_unlock_indicator();
@@ -459,7 +564,10 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if ((ksym == XKB_KEY_j || ksym == XKB_KEY_m) && !ctrl)
                 break;
 
-            if (auth_state == STATE_AUTH_WRONG) {
+            /* Verify this password once the last one turned out to be
+             * wrong. */
+            if (auth_state == STATE_AUTH_VERIFY ||
+                auth_state == STATE_AUTH_WRONG) {
                 retry_verification = true;
                 return;
             }
@@ -580,32 +688,72 @@ static void handle_visibility_notify(xcb_connection_t *conn,
  * Create a DAMAGE object to input/output class windows
  *
  */
-static void create_damage(xcb_connection_t *conn, xcb_window_t window,
-                          xcb_get_window_attributes_reply_t *win_attrib) {
-    if (win_attrib) {
-        if (win_attrib->_class != XCB_WINDOW_CLASS_INPUT_ONLY) {
-            xcb_damage_damage_t dam = xcb_generate_id(conn);
-            xcb_damage_create(conn, dam, window,
-                              XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+static void create_damage(xcb_connection_t *conn, window_t *window) {
+    if (!window->input_only && window->damage == XCB_NONE) {
+        window->damage = xcb_generate_id(conn);
+        xcb_damage_create(conn, window->damage, window->id,
+                          XCB_DAMAGE_REPORT_LEVEL_DELTA_RECTANGLES);
+    }
+}
+
+/*
+ * Destroys the DAMAGE objects of all windows.
+ *
+ */
+static void destroy_damage(xcb_connection_t *conn) {
+    for (int i = 0; i < windows_len; i++) {
+        if (windows[i].damage != XCB_NONE) {
+            xcb_damage_destroy(conn, windows[i].damage);
+            windows[i].damage = XCB_NONE;
         }
-        free(win_attrib);
     }
 }
 
-static void handle_map_notify(xcb_map_notify_event_t *event) {
-    maybe_close_sleep_lock_fd();
+/*
+ * Writes "READY=1" and the CLOCK_MONOTONIC time in microseconds to ready_fd,
+ * in the format of sd_notify(3). Outside of daemon mode, ready_fd is closed
+ * afterwards.
+ *
+ */
+static void notify_ready(void) {
+    /* Whatever was drawn so far is on the screen once the X server replies. */
+    xcb_aux_sync(conn);
+    DEBUG("locked after %.1f ms\n", (ev_time() - lock_start) * 1000);
+    if (ready_fd < 0) {
+        return;
+    }
 
-    if (fuzzy && !once) {
-        /* Create damage objects for new windows */
-        xcb_get_window_attributes_reply_t *attribs =
-            xcb_get_window_attributes_reply(
-                conn, xcb_get_window_attributes(conn, event->window), NULL);
-        create_damage(conn, event->window, attribs);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    char message[64];
+    const int len = snprintf(message, sizeof(message),
+                             "READY=1\nMONOTONIC_USEC=%llu\n",
+                             (unsigned long long)ts.tv_sec * 1000000 +
+                                 ts.tv_nsec / 1000);
+    if (write(ready_fd, message, len) != len) {
+        warn("Could not write to the ready fd");
+    }
+    if (!daemon_mode) {
+        close(ready_fd);
+        ready_fd = -1;
+    }
+}
+
+/*
+ * Forks once the lock window is mapped and the pointer and keyboard are
+ * grabbed, so that the parent process exits only then, e.g. to suspend
+ * afterwards. Once the first frame is shown as well, reports the lock on
+ * ready_fd and tells xss-lock.
+ *
+ */
+static void check_locked(void) {
+    if (!window_mapped || !input_grabbed) {
+        return;
     }
 
     if (!dont_fork) {
-        /* After the first MapNotify, we never fork again. We don’t
-         * expect to get another MapNotify, but better be sure… */
+        /* We only fork once. This has to happen before a password can be
+         * entered, since the child would not inherit auth_thread. */
         dont_fork = true;
 
         /* In the parent process, we exit */
@@ -614,6 +762,30 @@ static void handle_map_notify(xcb_map_notify_event_t *event) {
 
         ev_loop_fork(EV_DEFAULT);
     }
+
+    if (!frame_shown || lock_reported) {
+        return;
+    }
+    lock_reported = true;
+    notify_ready();
+    maybe_close_sleep_lock_fd();
+}
+
+static void handle_map_notify(xcb_map_notify_event_t *event) {
+    if (!screen_locked) {
+        return;
+    }
+    if (fuzzy && !once && !damage_suspended) {
+        /* Create damage objects for new windows. The window table already
+         * knows their class. */
+        window_t *window = window_table_find(event->window);
+        if (window != NULL) {
+            create_damage(conn, window);
+        }
+    }
+
+    window_mapped = true;
+    check_locked();
 }
 
 /*
@@ -668,6 +840,19 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     }
 }
 
+static void init_blur_coefficents() {
+    if (blur_radius == 0 || blur_sigma == 0) {
+        blur_scaled = true;
+        double fact = last_resolution[1] / 100.0;
+        blur_radius = (int)fact / 2;
+        blur_sigma = fact / 2.0;
+        if (debug_mode) {
+            fprintf(stderr, "scaling factor = %f\tradius = %d\tsigma = %f\n",
+                    fact, blur_radius, blur_sigma);
+        }
+    }
+}
+
 /*
  * Called when the properties on the root window change, e.g. when the screen
  * resolution changes. If so we update the window to cover the whole screen
@@ -692,7 +877,16 @@ void handle_screen_resize(void) {
 
     free(geom);
 
-    glx_resize(last_resolution[0], last_resolution[1]);
+    if (blur_scaled) {
+        blur_radius = 0;
+        blur_sigma = 0;
+        init_blur_coefficents();
+    }
+    glx_free_render_targets();
+
+    if (!screen_locked) {
+        return;
+    }
 
     resize_screen();
     redraw_screen();
@@ -758,7 +952,7 @@ static int conv_callback(int num_msg, const struct pam_message **msg,
 
         /* return code is currently not used but should be set to zero */
         resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
+        if ((resp[c]->resp = strdup(auth_password)) == NULL) {
             perror("strdup");
             return 1;
         }
@@ -766,6 +960,23 @@ static int conv_callback(int num_msg, const struct pam_message **msg,
 
     return 0;
 }
+
+/*
+ * Starts the PAM transaction for username. authenticate() ends it after the
+ * password was accepted, so in daemon mode a new one is started for every
+ * lock.
+ *
+ */
+static void start_pam(void) {
+    static const struct pam_conv conv = {conv_callback, NULL};
+    int ret;
+
+    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+
+    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+}
 #endif
 
 /*
@@ -798,29 +1009,13 @@ static void set_up_damage_notifications(xcb_connection_t *conn,
 
     dam_ext_data = xcb_get_extension_data(conn, &xcb_damage_id);
 
-    xcb_query_tree_reply_t *reply =
-        xcb_query_tree_reply(conn, xcb_query_tree(conn, scr->root), NULL);
-    xcb_window_t *children = xcb_query_tree_children(reply);
-    xcb_get_window_attributes_cookie_t *attribs =
-        (xcb_get_window_attributes_cookie_t *)malloc(
-            sizeof(xcb_get_window_attributes_cookie_t) * reply->children_len);
-
-    if (!attribs) {
-        errx(EXIT_FAILURE, "Failed to allocate memory");
-    }
-
-    for (int i = 0; i < reply->children_len; ++i) {
-        attribs[i] = xcb_get_window_attributes_unchecked(conn, children[i]);
-    }
-    for (int i = 0; i < reply->children_len; ++i) {
-        /* Get attributes to check if input-only window */
-        xcb_get_window_attributes_reply_t *attrib =
-            xcb_get_window_attributes_reply(conn, attribs[i], NULL);
-
-        create_damage(conn, children[i], attrib);
+    /* Windows which are not mapped yet get theirs in handle_map_notify(). */
+    window_table_init(conn, scr->root);
+    for (int i = 0; i < windows_len && !damage_suspended; ++i) {
+        if (windows[i].mapped) {
+            create_damage(conn, &windows[i]);
+        }
     }
-    free(attribs);
-    free(reply);
 }
 
 /*
@@ -836,7 +1031,146 @@ static void maybe_close_sleep_lock_fd(void) {
         if (*endptr == 0) {
             close(fd);
         }
+        /* The fd number may be reused, do not close it on the next lock in
+         * daemon mode. */
+        unsetenv("XSS_SLEEP_LOCK_FD");
+    }
+}
+
+/*
+ * Called when DPMS turns the monitors off or on. Nothing is drawn while they
+ * are off. In live fuzzy mode the damage objects are destroyed as well, and
+ * once the monitors are back on, the whole screen is captured and blurred
+ * again instead.
+ *
+ */
+static void dpms_changed(bool monitor_off) {
+    if (monitor_off) {
+        blanked_wakeups = 0;
+        blanked_since = ev_now(main_loop);
+        if (fuzzy && !once && screen_locked) {
+            destroy_damage(conn);
+            STOP_TIMER(damage_redraw_timeout);
+            damage_events = 0;
+            damage_suspended = true;
+        }
+        return;
+    }
+
+    ev_now_update(main_loop);
+    const ev_tstamp blanked = ev_now(main_loop) - blanked_since;
+    DEBUG("%d wakeups in %.1f s while the monitors were off, %.2f per "
+          "second\n",
+          blanked_wakeups, blanked,
+          (blanked > 0) ? blanked_wakeups / blanked : 0);
+    if (!screen_locked) {
+        return;
+    }
+    if (damage_suspended) {
+        damage_suspended = false;
+        for (int i = 0; i < windows_len; i++) {
+            if (windows[i].mapped) {
+                create_damage(conn, &windows[i]);
+            }
+        }
+        add_damage((xcb_rectangle_t){0, 0, last_resolution[0],
+                                     last_resolution[1]});
     }
+    redraw_screen();
+}
+
+/*
+ * Gives up after the lock failed message was shown for a second. In daemon
+ * mode, the next SIGUSR1 tries again.
+ *
+ */
+static void lock_failed_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(lock_failed_timeout);
+    if (!daemon_mode) {
+        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+    }
+    warnx("Cannot grab pointer/keyboard");
+    unlock_screen();
+}
+
+/*
+ * Called once grabbing the pointer and keyboard succeeded or failed.
+ *
+ */
+static void grab_done(bool grabbed) {
+    if (!grabbed) {
+        auth_state = STATE_I3LOCK_LOCK_FAILED;
+        redraw_unlock_indicator();
+        /* The event loop keeps running meanwhile, so that the frame is drawn
+         * even if Present holds it back. */
+        START_TIMER(lock_failed_timeout, TSTAMP_N_SECS(1), lock_failed_cb);
+        return;
+    }
+
+    /* Load the keymap again to sync the current modifier state. Since we first
+     * loaded the keymap, there might have been changes, but starting from now,
+     * we should get all key presses/releases due to having grabbed the
+     * keyboard. */
+    (void)load_keymap();
+
+    /* Explicitly redraw the unlock indicator in case "locking…" message was
+     * displayed */
+    auth_state = STATE_AUTH_IDLE;
+    redraw_unlock_indicator();
+
+    input_grabbed = true;
+    check_locked();
+}
+
+/*
+ * Called once the first frame of a lock is on the screen, or is taken to be.
+ *
+ */
+static void first_frame_shown(void) {
+    STOP_TIMER(first_frame_timeout);
+    if (screen_locked && !frame_shown) {
+        frame_shown = true;
+        check_locked();
+    }
+}
+
+static void first_frame_timeout_cb(EV_P_ ev_timer *w, int revents) {
+    DEBUG("no CompleteNotify for the first frame\n");
+    first_frame_shown();
+}
+
+/*
+ * Redraws everything that was damaged since the last frame.
+ *
+ */
+static void damage_redraw_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(damage_redraw_timeout);
+    DEBUG("redrawing after %d damage events\n", damage_events);
+    damage_events = 0;
+    last_damage_redraw = ev_now(main_loop);
+    redraw_screen();
+}
+
+/*
+ * Schedules a redraw of the damaged parts of the screen, no sooner than
+ * 1/max_fps seconds after the previous one. Damage reported until then is
+ * drawn by the same frame, so a video playing behind the lock screen costs at
+ * most max_fps frames per second.
+ *
+ */
+static void schedule_damage_redraw(void) {
+    if (damage_redraw_timeout != NULL) {
+        return;
+    }
+    ev_tstamp delay = 0;
+    if (max_fps > 0) {
+        ev_now_update(main_loop);
+        delay = last_damage_redraw + 1.0 / max_fps - ev_now(main_loop);
+        if (delay < 0) {
+            delay = 0;
+        }
+    }
+    START_TIMER(damage_redraw_timeout, delay, damage_redraw_cb);
 }
 
 /*
@@ -846,11 +1180,17 @@ static void maybe_close_sleep_lock_fd(void) {
  */
 static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     xcb_generic_event_t *event;
+    bool damaged = false;
 
     if (xcb_connection_has_error(conn))
         errx(EXIT_FAILURE,
              "X11 connection broke, did your server terminate?\n");
 
+    /* This runs once for every iteration of the event loop. */
+    if (dpms_monitor_off()) {
+        blanked_wakeups++;
+    }
+
     while ((event = xcb_poll_for_event(conn)) != NULL) {
         if (event->response_type == 0) {
             xcb_generic_error_t *error = (xcb_generic_error_t *)event;
@@ -873,12 +1213,34 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
             continue;
         }
 
-        if (fuzzy && !once &&
+        if (dpms_handle_event(event)) {
+            free(event);
+            continue;
+        }
+
+        if (present_handle_event(event)) {
+            first_frame_shown();
+            redraw_deferred();
+            free(event);
+            continue;
+        }
+
+        if (fuzzy && !once && !damage_suspended &&
             event->response_type ==
                 dam_ext_data->first_event + XCB_DAMAGE_NOTIFY) {
             xcb_damage_notify_event_t *ev = (xcb_damage_notify_event_t *)event;
             xcb_damage_subtract(conn, ev->damage, XCB_NONE, XCB_NONE);
-            redraw_screen();
+            /* The area is relative to the damaged top-level window. Collect
+             * all damage in the queue and redraw it at once. */
+            add_damage((xcb_rectangle_t){ev->geometry.x + ev->area.x,
+                                         ev->geometry.y + ev->area.y,
+                                         ev->area.width, ev->area.height});
+            damage_events++;
+            damaged = true;
+        }
+
+        if (fuzzy && !once) {
+            window_table_handle_event(conn, event);
         }
 
         /* Strip off the highest bit (set if the event is generated) */
@@ -899,7 +1261,13 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                 break;
 
             case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
+                /* The root window reports configure events of all top-level
+                 * windows as well, only the screen size matters here. */
+                if (((xcb_configure_notify_event_t *)event)->window ==
+                        screen->root ||
+                    ((xcb_configure_notify_event_t *)event)->window == win) {
+                    handle_screen_resize();
+                }
                 break;
 
             default:
@@ -915,86 +1283,186 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
         free(event);
     }
+
+    if (damaged) {
+        schedule_damage_redraw();
+    }
 }
 
 /*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to the authentication backend.
+ * Opens the lock window and starts grabbing the pointer and keyboard. The
+ * screen counts as locked once check_locked() says so.
  *
  */
-static void raise_loop(xcb_window_t window) {
-    xcb_connection_t *conn;
-    xcb_generic_event_t *event;
-    int screens;
+static void lock_screen(void) {
+    lock_start = ev_time();
+    screen_locked = true;
+
+    /* Pixmap on which the image is rendered to (if any). In live fuzzy mode,
+     * redraw_screen() sets up its own pixmaps on the first frame. */
+    xcb_pixmap_t bg_pixmap = XCB_NONE;
+    if (fuzzy && once) {
+        /* Blurring takes a while, so the window first shows a coarse preview
+         * of the captured screen. The real blur replaces it below. */
+        once_pixmap = draw_image(last_resolution);
+        bg_pixmap = render_blur_preview(conn, screen, once_pixmap,
+                                        last_resolution[0], last_resolution[1]);
+    } else if (!fuzzy) {
+        bg_pixmap = draw_image(last_resolution);
+    }
 
-    if (xcb_connection_has_error((conn = xcb_connect(NULL, &screens))) > 0)
-        errx(EXIT_FAILURE, "Cannot open display\n");
+    /* open the fullscreen window, already with the correct pixmap in place */
+    if (fuzzy && !once) {
+        win = open_overlay_window(conn, screen);
+        present_init(conn, win);
+    } else {
+        stolen_focus = find_focused_window(conn, screen->root);
+        win = open_fullscreen_window(conn, screen, color, bg_pixmap);
+    }
+    if (bg_pixmap != XCB_NONE) {
+        blur_release_pixmap(bg_pixmap);
+        xcb_free_pixmap(conn, bg_pixmap);
+    }
 
-    /* We need to know about the window being obscured or getting destroyed. */
-    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){XCB_EVENT_MASK_VISIBILITY_CHANGE |
-                                              XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-    xcb_flush(conn);
+    cursor = create_cursor(conn, screen, win, curs_choice);
 
-    DEBUG("Watching window 0x%08x\n", window);
-    while ((event = xcb_wait_for_event(conn)) != NULL) {
-        if (event->response_type == 0) {
-            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
-            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
-                  error->sequence, error->error_code);
-            free(event);
-            continue;
-        }
-        /* Strip off the highest bit (set if the event is generated) */
-        int type = (event->response_type & 0x7F);
-        DEBUG("Read event of type %d\n", type);
-        switch (type) {
-            case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(
-                    conn, (xcb_visibility_notify_event_t *)event);
-                break;
-            case XCB_UNMAP_NOTIFY:
-                DEBUG("UnmapNotify for 0x%08x\n",
-                      (((xcb_unmap_notify_event_t *)event)->window));
-                if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            case XCB_DESTROY_NOTIFY:
-                DEBUG("DestroyNotify for 0x%08x\n",
-                      (((xcb_destroy_notify_event_t *)event)->window));
-                if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            default:
-                DEBUG("Unhandled event type %d\n", type);
-                break;
-        }
-        free(event);
+    /* The "locking…" message is displayed if grabbing the pointer/keyboard
+     * takes a while. The rest of the setup goes on meanwhile. */
+    auth_state = STATE_AUTH_LOCK;
+    grab_pointer_and_keyboard(conn, screen, win, cursor, main_loop, grab_done);
+
+    if (fuzzy && !once) {
+        /* Set up damage notifications, unless the monitors are off already.
+         * dpms_changed() sets them up once they are back on. */
+        damage_suspended = dpms_monitor_off();
+        set_up_damage_notifications(conn, screen);
+    }
+
+    if (fuzzy && once) {
+        /* open_fullscreen_window() waits until the window is mapped. */
+        DEBUG("screen covered after %.1f ms\n",
+              (ev_time() - lock_start) * 1000);
+
+        /* For once, store the blurred background as img */
+        blur_image(0, once_pixmap, last_resolution[0], last_resolution[1],
+                   blur_radius, blur_sigma);
+        img = cairo_xcb_surface_create(conn, once_pixmap,
+                                       get_root_visual_type(screen),
+                                       last_resolution[0], last_resolution[1]);
+    }
+
+    redraw_screen();
+
+    if (debug_mode && fuzzy && once) {
+        /* Only wait for the X server to show the blur when measuring it. */
+        xcb_aux_sync(conn);
+        DEBUG("final blur shown after %.1f ms\n",
+              (ev_time() - lock_start) * 1000);
+    }
+
+    /* With Present, the first frame is shown once it completes. Nothing is
+     * drawn while the monitors are off. */
+    if (!present_available() || dpms_monitor_off()) {
+        frame_shown = true;
+    } else {
+        START_TIMER(first_frame_timeout, TSTAMP_N_SECS(0.25),
+                    first_frame_timeout_cb);
+    }
+
+    /* usually the window counts as mapped in the mapnotify event handler, but
+     * in our case a new window is not created and so the mapnotify event
+     * doesn't come */
+    if (fuzzy) {
+        window_mapped = true;
+        check_locked();
     }
 }
 
-static void init_blur_coefficents() {
-    if (blur_radius == 0 || blur_sigma == 0) {
-        double fact = last_resolution[1] / 100.0;
-        blur_radius = (int)fact / 2;
-        blur_sigma = fact / 2.0;
-        if (debug_mode) {
-            fprintf(stderr, "scaling factor = %f\tradius = %d\tsigma = %f\n",
-                    fact, blur_radius, blur_sigma);
+/*
+ * Closes the lock window in daemon mode, after a successful authentication or
+ * when locking failed. The X11 connection, keymap, image and GL context stay
+ * around for the next lock_screen().
+ *
+ */
+static void unlock_screen(void) {
+    xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+    xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+
+    if (fuzzy && !once) {
+        destroy_damage(conn);
+        present_stop();
+        close_overlay_window(conn, screen);
+    } else {
+        xcb_destroy_window(conn, win);
+        if (stolen_focus != XCB_NONE) {
+            DEBUG("restoring focus to X11 window 0x%08x\n", stolen_focus);
+            set_focused_window(conn, screen->root, stolen_focus);
+            stolen_focus = XCB_NONE;
         }
     }
+    win = XCB_NONE;
+    /* Nothing keeps the window table up to date until the next lock, not even
+     * in once mode, where it is only filled to capture the screen. */
+    window_table_free(conn);
+
+    if (cursor != XCB_NONE) {
+        xcb_free_cursor(conn, cursor);
+        cursor = XCB_NONE;
+    }
+
+    resize_screen();
+    if (once_pixmap != XCB_NONE) {
+        cairo_surface_destroy(img);
+        img = NULL;
+        blur_release_pixmap(once_pixmap);
+        xcb_free_pixmap(conn, once_pixmap);
+        once_pixmap = XCB_NONE;
+    }
+
+    STOP_TIMER(clear_auth_wrong_timeout);
+    STOP_TIMER(clear_indicator_timeout);
+    STOP_TIMER(discard_passwd_timeout);
+    STOP_TIMER(damage_redraw_timeout);
+    STOP_TIMER(first_frame_timeout);
+    damage_events = 0;
+    damage_suspended = false;
+
+    /* Start over with what was typed after the password. */
+    clear_input();
+    auth_state = STATE_AUTH_IDLE;
+    unlock_state = STATE_STARTED;
+    failed_attempts = 0;
+    retry_verification = false;
+    free(modifier_string);
+    modifier_string = NULL;
+
+    window_mapped = false;
+    input_grabbed = false;
+    frame_shown = false;
+    lock_reported = false;
+    screen_locked = false;
+
+#ifndef __OpenBSD__
+    if (pam_handle == NULL) {
+        start_pam();
+    }
+#endif
+    xcb_flush(conn);
+    DEBUG("unlocked, waiting for SIGUSR1\n");
+}
+
+static void lock_signal_cb(EV_P_ ev_signal *w, int revents) {
+    if (screen_locked) {
+        DEBUG("SIGUSR1 while already locked\n");
+        return;
+    }
+    DEBUG("locking on SIGUSR1\n");
+    lock_screen();
 }
 
 int main(int argc, char *argv[]) {
     struct passwd *pw;
-    char *username;
     char *image_path = NULL;
-#ifndef __OpenBSD__
-    int ret;
-    struct pam_conv conv = {conv_callback, NULL};
-#endif
-    int curs_choice = CURS_NONE;
     int o;
     int longoptind = 0;
     struct option longopts[] = {
@@ -1016,12 +1484,20 @@ int main(int argc, char *argv[]) {
         {"ignore-empty-password", no_argument, NULL, 'e'},
         {"inactivity-timeout", required_argument, NULL, 'I'},
         {"show-failed-attempts", no_argument, NULL, 'l'},
+        {"blur-backend", required_argument, NULL, 0},
+        {"blur-method", required_argument, NULL, 0},
+        {"max-fps", required_argument, NULL, 0},
+        {"daemon", no_argument, NULL, 0},
+        {"ready-fd", required_argument, NULL, 0},
         {NULL, no_argument, NULL, 0}};
 
     if ((pw = getpwuid(getuid())) == NULL)
         err(EXIT_FAILURE, "getpwuid() failed");
-    if ((username = pw->pw_name) == NULL)
+    if (pw->pw_name == NULL)
         errx(EXIT_FAILURE, "pw->pw_name is NULL.\n");
+#ifndef __OpenBSD__
+    username = strdup(pw->pw_name);
+#endif
 
     char *optstring = "hvnbdc:op:ui:tfr:s:eI:l";
     while ((o = getopt_long(argc, argv, optstring, longopts, &longoptind)) != -1) {
@@ -1093,6 +1569,42 @@ int main(int argc, char *argv[]) {
             case 0:
                 if (strcmp(longopts[longoptind].name, "debug") == 0)
                     debug_mode = true;
+                else if (strcmp(longopts[longoptind].name, "blur-backend") == 0) {
+                    if (!strcmp(optarg, "gl")) {
+                        blur_backend = BLUR_BACKEND_GL;
+                    } else if (!strcmp(optarg, "cpu")) {
+                        blur_backend = BLUR_BACKEND_CPU;
+                    } else {
+                        errx(EXIT_FAILURE, "i3lock: Invalid blur backend given. "
+                                           "Expected one of \"gl\" or "
+                                           "\"cpu\".\n");
+                    }
+                } else if (strcmp(longopts[longoptind].name, "blur-method") == 0) {
+                    if (!strcmp(optarg, "gaussian")) {
+                        blur_method = BLUR_METHOD_GAUSSIAN;
+                    } else if (!strcmp(optarg, "pyramid")) {
+                        blur_method = BLUR_METHOD_PYRAMID;
+                    } else {
+                        errx(EXIT_FAILURE, "i3lock: Invalid blur method given. "
+                                           "Expected one of \"gaussian\" or "
+                                           "\"pyramid\".\n");
+                    }
+                } else if (strcmp(longopts[longoptind].name, "max-fps") == 0) {
+                    if (sscanf(optarg, "%lf", &max_fps) != 1 || max_fps < 0) {
+                        errx(EXIT_FAILURE, "i3lock: Invalid max FPS given. "
+                                           "Expected a number, or 0 for no "
+                                           "limit.\n");
+                    }
+                } else if (strcmp(longopts[longoptind].name, "daemon") == 0) {
+                    daemon_mode = true;
+                    dont_fork = true;
+                } else if (strcmp(longopts[longoptind].name, "ready-fd") == 0) {
+                    if (sscanf(optarg, "%d", &ready_fd) != 1 || ready_fd < 0) {
+                        errx(EXIT_FAILURE, "i3lock: Invalid ready fd given. "
+                                           "Expected a file descriptor "
+                                           "number.\n");
+                    }
+                }
                 break;
             case 'l':
                 show_failed_attempts = true;
@@ -1101,7 +1613,11 @@ int main(int argc, char *argv[]) {
                 errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b] [-d] [-c "
                                    "color] [-u] [-p win|default]"
                                    " [-i image.png] [-t] [-f] [-r radius] [-s "
-                                   "sigma] [-e] [-I timeout] [-l]");
+                                   "sigma] [-e] [-I timeout] [-l] [-o]"
+                                   " [--blur-backend=gl|cpu]"
+                                   " [--blur-method=gaussian|pyramid]"
+                                   " [--max-fps=fps] [--daemon]"
+                                   " [--ready-fd=fd]");
         }
     }
 
@@ -1111,11 +1627,7 @@ int main(int argc, char *argv[]) {
 
 #ifndef __OpenBSD__
     /* Initialize PAM */
-    if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
-
-    if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
-        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+    start_pam();
 #endif
 
 /* Using mlock() as non-super-user seems only possible in Linux.
@@ -1127,7 +1639,8 @@ int main(int argc, char *argv[]) {
     /* Lock the area where we store the password in memory, we don’t want it to
      * be swapped to disk. Since Linux 2.6.9, this does not require any
      * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
+    if (mlock(password, sizeof(password)) != 0 ||
+        mlock(auth_password, sizeof(auth_password)) != 0)
         err(EXIT_FAILURE,
             "Could not lock page in memory, check RLIMIT_MEMLOCK");
 #endif
@@ -1179,14 +1692,6 @@ int main(int argc, char *argv[]) {
 
     load_compose_table(locale);
 
-    /* check if the X server supports DPMS */
-    xcb_dpms_capable_cookie_t dpmsc = xcb_dpms_capable(conn);
-    xcb_dpms_capable_reply_t *dpmsr;
-    if ((dpmsr = xcb_dpms_capable_reply(conn, dpmsc, NULL))) {
-        dpms_capable = dpmsr->capable;
-        free(dpmsr);
-    }
-
     screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
 
     randr_init(&randr_base, screen->root);
@@ -1214,83 +1719,25 @@ int main(int argc, char *argv[]) {
         init_blur_coefficents();
     }
 
-    /* Pixmap on which the image is rendered to (if any) */
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-
-    /* For once, store the blurred background as img */
-    if (fuzzy & once) {
-        blur_image_gl(0, bg_pixmap, last_resolution[0], last_resolution[1],
-                      blur_radius, blur_sigma);
-        img = cairo_xcb_surface_create(conn, bg_pixmap,
-                                       get_root_visual_type(screen),
-                                       last_resolution[0], last_resolution[1]);
-        bg_pixmap = draw_image(last_resolution);
-    }
-
-    xcb_window_t stolen_focus = XCB_NONE;
-
-    /* open the fullscreen window, already with the correct pixmap in place */
-    if (fuzzy && !once) {
-        win = open_overlay_window(conn, screen);
-    } else {
-        stolen_focus = find_focused_window(conn, screen->root);
-        win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    }
-    xcb_free_pixmap(conn, bg_pixmap);
-
-    cursor = create_cursor(conn, screen, win, curs_choice);
-
-    /* Display the "locking…" message while trying to grab the pointer/keyboard. */
-    auth_state = STATE_AUTH_LOCK;
-    if (!grab_pointer_and_keyboard(conn, screen, cursor, 1000)) {
-        DEBUG("stole focus from X11 window 0x%08x\n", stolen_focus);
-
-        /* Set the focus to i3lock, possibly closing context menus which would
-         * otherwise prevent us from grabbing keyboard/pointer.
-         *
-         * We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
-         * works for managed windows, but i3lock uses an unmanaged window
-         * (override_redirect=1). */
-        xcb_set_input_focus(conn, XCB_INPUT_FOCUS_PARENT /* revert_to */, win, XCB_CURRENT_TIME);
-        if (!grab_pointer_and_keyboard(conn, screen, cursor, 9000)) {
-            auth_state = STATE_I3LOCK_LOCK_FAILED;
-            redraw_screen();
-            sleep(1);
-            errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
-        }
-    }
-
-    maybe_close_sleep_lock_fd();
-    if (fuzzy && !once) {
-        /* Set up damage notifications */
-        set_up_damage_notifications(conn, screen);
-    } else {
-        pid_t pid = fork();
-        /* The pid == -1 case is intentionally ignored here:
-         * While the child process is useful for preventing other windows from
-         * popping up while i3lock blocks, it is not critical. */
-        if (pid == 0) {
-            /* Child */
-            close(xcb_get_file_descriptor(conn));
-            raise_loop(win);
-            exit(EXIT_SUCCESS);
-        }
-    }
-
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
-
     /* Initialize the libev event loop. */
     main_loop = EV_DEFAULT;
     if (main_loop == NULL)
         errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
 
-    /* Explicitly call the screen redraw in case "locking…" message was displayed */
-    auth_state = STATE_AUTH_IDLE;
-    redraw_screen();
+    auth_done = calloc(1, sizeof(struct ev_async));
+    ev_async_init(auth_done, auth_done_cb);
+    ev_async_start(main_loop, auth_done);
+
+    dpms_init(conn, main_loop, dpms_changed);
+
+    if (daemon_mode) {
+        struct ev_signal *lock_signal = calloc(sizeof(struct ev_signal), 1);
+        ev_signal_init(lock_signal, lock_signal_cb, SIGUSR1);
+        ev_signal_start(main_loop, lock_signal);
+        DEBUG("waiting for SIGUSR1\n");
+    } else {
+        lock_screen();
+    }
 
     struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
@@ -1310,17 +1757,6 @@ int main(int argc, char *argv[]) {
      * received up until now. ev will only pick up new events (when the X11
      * file descriptor becomes readable). */
     ev_invoke(main_loop, xcb_check, 0);
-    /* usually fork is called from mapnotify event handler, but in our case
-     * a new window is not created and so the mapnotify event doesn't come */
-    if (fuzzy && !dont_fork) {
-        dont_fork = true;
-
-        /* In the parent process, we exit */
-        if (fork() != 0)
-            exit(0);
-
-        ev_loop_fork(EV_DEFAULT);
-    }
     ev_loop(main_loop, 0);
 
     if (fuzzy) {
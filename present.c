@@ -0,0 +1,160 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * present.c: Puts frames on the screen with the Present extension, which
+ *            copies them into the window during vertical blank. At most one
+ *            frame is queued, the next one is only drawn once the X server
+ *            reports the previous one as complete.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <xcb/present.h>
+#include <xcb/xcb.h>
+#include <xcb/xfixes.h>
+
+#include "i3lock.h"
+#include "present.h"
+
+extern bool debug_mode;
+
+/* If the X server does not report a frame as complete within this time, for
+ * example because the output is off, the next frame is drawn anyway. */
+#define COMPLETE_TIMEOUT_USEC 250000
+
+/* The window frames are presented to, XCB_NONE without Present. */
+static xcb_window_t target = XCB_NONE;
+static uint8_t present_opcode;
+static uint32_t serial = 0;
+static bool busy = false;
+/* CLOCK_MONOTONIC time at which the frame in flight was submitted, in
+ * microseconds like the UST in CompleteNotify. */
+static uint64_t submitted;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Sets up presenting to the given window. Returns false if the X server lacks
+ * the Present or XFixes extension, in which case the caller keeps updating
+ * the window background itself.
+ *
+ */
+bool present_init(xcb_connection_t *conn, xcb_window_t window) {
+    const xcb_query_extension_reply_t *present =
+        xcb_get_extension_data(conn, &xcb_present_id);
+    const xcb_query_extension_reply_t *xfixes =
+        xcb_get_extension_data(conn, &xcb_xfixes_id);
+    if (present == NULL || !present->present || xfixes == NULL ||
+        !xfixes->present) {
+        DEBUG("present: extension not available\n");
+        return false;
+    }
+
+    xcb_present_query_version_cookie_t present_cookie =
+        xcb_present_query_version(conn, XCB_PRESENT_MAJOR_VERSION,
+                                  XCB_PRESENT_MINOR_VERSION);
+    /* XFixes requires the version to be queried before using it. */
+    xcb_xfixes_query_version_cookie_t xfixes_cookie = xcb_xfixes_query_version(
+        conn, XCB_XFIXES_MAJOR_VERSION, XCB_XFIXES_MINOR_VERSION);
+    xcb_present_query_version_reply_t *present_version =
+        xcb_present_query_version_reply(conn, present_cookie, NULL);
+    xcb_xfixes_query_version_reply_t *xfixes_version =
+        xcb_xfixes_query_version_reply(conn, xfixes_cookie, NULL);
+    const bool ok = present_version != NULL && xfixes_version != NULL &&
+                    xfixes_version->major_version >= 2;
+    free(present_version);
+    free(xfixes_version);
+    if (!ok) {
+        DEBUG("present: version query failed\n");
+        return false;
+    }
+
+    present_opcode = present->major_opcode;
+    xcb_present_select_input(conn, xcb_generate_id(conn), window,
+                             XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY);
+    target = window;
+    DEBUG("present: presenting to window 0x%08x\n", window);
+    return true;
+}
+
+/*
+ * Stops presenting, e.g. because the window is gone. A frame still in flight
+ * is forgotten.
+ *
+ */
+void present_stop(void) {
+    target = XCB_NONE;
+    busy = false;
+}
+
+bool present_available(void) {
+    return target != XCB_NONE;
+}
+
+/*
+ * Returns true while the last frame is not on the screen yet.
+ *
+ */
+bool present_busy(void) {
+    if (busy && now_usec() - submitted > COMPLETE_TIMEOUT_USEC) {
+        DEBUG("present: no CompleteNotify for frame %u\n", serial);
+        busy = false;
+    }
+    return busy;
+}
+
+/*
+ * Queues the given parts of pixmap to be copied into the window at the next
+ * vertical blank. It must not be drawn to until the frame completes.
+ *
+ */
+void present_frame(xcb_connection_t *conn, xcb_pixmap_t pixmap,
+                   const xcb_rectangle_t *rects, int len) {
+    xcb_xfixes_region_t update = xcb_generate_id(conn);
+    xcb_xfixes_create_region(conn, update, len, rects);
+
+    /* Copy instead of flipping. After a flip, the pixmap would stay on the
+     * screen until the next one, and could only be drawn to again after its
+     * IdleNotify. Since at most one frame is in flight, the buffer drawn next
+     * is always free after a copy. */
+    xcb_present_pixmap(conn, target, pixmap, ++serial, XCB_NONE, update, 0, 0,
+                       XCB_NONE, XCB_NONE, XCB_NONE, XCB_PRESENT_OPTION_COPY,
+                       0, 0, 0, 0, NULL);
+    xcb_xfixes_destroy_region(conn, update);
+
+    busy = true;
+    submitted = now_usec();
+}
+
+/*
+ * Handles CompleteNotify for the frame in flight. Returns true if event was
+ * such an event, after which the next frame can be drawn.
+ *
+ */
+bool present_handle_event(const xcb_generic_event_t *event) {
+    if (target == XCB_NONE || event->response_type != XCB_GE_GENERIC) {
+        return false;
+    }
+    const xcb_present_complete_notify_event_t *ev =
+        (const xcb_present_complete_notify_event_t *)event;
+    if (ev->extension != present_opcode ||
+        ev->event_type != XCB_PRESENT_EVENT_COMPLETE_NOTIFY ||
+        ev->serial != serial) {
+        return false;
+    }
+
+    busy = false;
+    DEBUG("present: frame %u %s at msc %llu, %.2f ms after submission\n",
+          ev->serial,
+          (ev->mode == XCB_PRESENT_COMPLETE_MODE_SKIP) ? "skipped" : "shown",
+          (unsigned long long)ev->msc,
+          ((int64_t)ev->ust - (int64_t)submitted) / 1e3);
+    return true;
+}
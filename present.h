@@ -0,0 +1,15 @@
+#ifndef _PRESENT_H
+#define _PRESENT_H
+
+#include <stdbool.h>
+#include <xcb/xcb.h>
+
+bool present_init(xcb_connection_t *conn, xcb_window_t window);
+void present_stop(void);
+bool present_available(void);
+bool present_busy(void);
+void present_frame(xcb_connection_t *conn, xcb_pixmap_t pixmap,
+                   const xcb_rectangle_t *rects, int len);
+bool present_handle_event(const xcb_generic_event_t *event);
+
+#endif
@@ -0,0 +1,229 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * program_cache.c: Keeps linked GL programs in $XDG_CACHE_HOME/i3lock using
+ *                  GL_ARB_get_program_binary, so that the blur shaders do not
+ *                  have to be compiled every time the screen is locked.
+ *
+ */
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "i3lock.h"
+#include "program_cache.h"
+
+extern bool debug_mode;
+
+/* Every cache file starts with this header, followed by the binary. */
+typedef struct {
+    char magic[8];
+    uint32_t format;
+    uint32_t length;
+} cache_header_t;
+
+static const char CACHE_MAGIC[8] = {'i', '3', 'l', 'o', 'c', 'k', 'p', 'b'};
+
+/* NULL if the driver cannot return program binaries or there is no usable
+ * cache directory. */
+static char *cache_dir = NULL;
+static bool cache_initialized = false;
+
+static bool cache_init(void) {
+    if (cache_initialized) {
+        return cache_dir != NULL;
+    }
+    cache_initialized = true;
+
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (formats == 0) {
+        DEBUG("program cache: the GL driver does not support program "
+              "binaries\n");
+        return false;
+    }
+
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *base = NULL;
+    if (xdg_cache_home != NULL && xdg_cache_home[0] == '/') {
+        base = strdup(xdg_cache_home);
+    } else if (home == NULL || asprintf(&base, "%s/.cache", home) == -1) {
+        base = NULL;
+    }
+    if (base == NULL) {
+        return false;
+    }
+
+    if (mkdir(base, 0700) != 0 && errno != EEXIST) {
+        DEBUG("program cache: cannot create %s: %s\n", base, strerror(errno));
+        free(base);
+        return false;
+    }
+    if (asprintf(&cache_dir, "%s/i3lock", base) == -1) {
+        cache_dir = NULL;
+        free(base);
+        return false;
+    }
+    free(base);
+
+    if (mkdir(cache_dir, 0700) != 0 && errno != EEXIST) {
+        DEBUG("program cache: cannot create %s: %s\n", cache_dir,
+              strerror(errno));
+        free(cache_dir);
+        cache_dir = NULL;
+    }
+    return cache_dir != NULL;
+}
+
+static uint64_t fnv1a(uint64_t hash, const char *s) {
+    /* The terminating NUL is hashed as well, so that the concatenated
+     * strings are unambiguous. */
+    for (;; s++) {
+        hash ^= (uint8_t)*s;
+        hash *= 0x100000001b3ULL;
+        if (*s == '\0') {
+            return hash;
+        }
+    }
+}
+
+/*
+ * Builds the path of the cache file for a program. The key covers the shader
+ * sources, which contain the kernel (and therefore radius and sigma), as well
+ * as the GL renderer and driver version, since binaries are only valid for the
+ * driver which produced them.
+ *
+ */
+static bool cache_path(char *path, size_t size, const char *vertex_source,
+                       const char *fragment_source) {
+    if (!cache_init()) {
+        return false;
+    }
+    const char *renderer = (const char *)glGetString(GL_RENDERER);
+    const char *version = (const char *)glGetString(GL_VERSION);
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, renderer ? renderer : "");
+    hash = fnv1a(hash, version ? version : "");
+    hash = fnv1a(hash, vertex_source);
+    hash = fnv1a(hash, fragment_source);
+
+    const int len =
+        snprintf(path, size, "%s/program-%016" PRIx64 ".bin", cache_dir, hash);
+    return len > 0 && (size_t)len < size;
+}
+
+/*
+ * Returns the cached program for the given sources, or 0 if there is none or
+ * the driver rejects it.
+ *
+ */
+GLuint program_cache_load(const char *vertex_source,
+                          const char *fragment_source) {
+    char path[PATH_MAX];
+    if (!cache_path(path, sizeof(path), vertex_source, fragment_source)) {
+        return 0;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    cache_header_t header;
+    void *binary = NULL;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        (binary = malloc(header.length)) == NULL ||
+        fread(binary, header.length, 1, file) != 1) {
+        DEBUG("program cache: ignoring invalid file %s\n", path);
+        fclose(file);
+        free(binary);
+        return 0;
+    }
+    fclose(file);
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary, header.length);
+    free(binary);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+        /* Most likely the driver was updated, replace the binary. */
+        DEBUG("program cache: driver rejected %s\n", path);
+        glDeleteProgram(program);
+        unlink(path);
+        return 0;
+    }
+    DEBUG("program cache: loaded %s\n", path);
+    return program;
+}
+
+/*
+ * Must be called before linking a program which will be passed to
+ * program_cache_store().
+ *
+ */
+void program_cache_prepare(GLuint program) {
+    if (cache_init()) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
+}
+
+/*
+ * Saves the binary of a linked program. The file is written under a temporary
+ * name and renamed, so that concurrently starting instances never read a
+ * partial file.
+ *
+ */
+void program_cache_store(GLuint program, const char *vertex_source,
+                         const char *fragment_source) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 16];
+    if (!cache_path(path, sizeof(path), vertex_source, fragment_source)) {
+        return;
+    }
+
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    void *binary = length > 0 ? malloc(length) : NULL;
+    if (binary == NULL) {
+        return;
+    }
+    cache_header_t header;
+    GLenum format;
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    glGetProgramBinary(program, length, NULL, &format, binary);
+    header.format = format;
+    header.length = length;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        DEBUG("program cache: cannot write %s: %s\n", tmp_path,
+              strerror(errno));
+        free(binary);
+        return;
+    }
+    const bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                         fwrite(binary, length, 1, file) == 1;
+    if (fclose(file) != 0 || !written || rename(tmp_path, path) != 0) {
+        DEBUG("program cache: cannot write %s\n", path);
+        unlink(tmp_path);
+    } else {
+        DEBUG("program cache: stored %s\n", path);
+    }
+    free(binary);
+}
@@ -0,0 +1,12 @@
+#ifndef _PROGRAM_CACHE_H
+#define _PROGRAM_CACHE_H
+
+#include <GL/gl.h>
+
+GLuint program_cache_load(const char *vertex_source,
+                          const char *fragment_source);
+void program_cache_prepare(GLuint program);
+void program_cache_store(GLuint program, const char *vertex_source,
+                         const char *fragment_source);
+
+#endif
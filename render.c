@@ -0,0 +1,189 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * render.c: Sets up compositing with the Render extension. The window
+ *           buffers and the unlock indicator have Pictures which live as
+ *           long as their pixmaps, so that putting the unlock indicator on
+ *           a frame is one composite request per screen.
+ *
+ */
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/render.h>
+#include <xcb/xcb.h>
+
+#include "i3lock.h"
+#include "render.h"
+
+extern bool debug_mode;
+
+/* How much render_blur_preview() scales the screen down. */
+#define PREVIEW_SCALE 16
+
+/* The format of pixmaps with the depth and visual of the root window. */
+static xcb_render_pictformat_t root_format = 0;
+/* 32 bit ARGB with premultiplied alpha, as cairo uses for images. */
+static xcb_render_pictforminfo_t argb32_format;
+
+static bool is_argb32(const xcb_render_pictforminfo_t *format) {
+    const xcb_render_directformat_t *direct = &format->direct;
+    return format->type == XCB_RENDER_PICT_TYPE_DIRECT &&
+           format->depth == 32 && direct->alpha_shift == 24 &&
+           direct->alpha_mask == 0xff && direct->red_shift == 16 &&
+           direct->red_mask == 0xff && direct->green_shift == 8 &&
+           direct->green_mask == 0xff && direct->blue_shift == 0 &&
+           direct->blue_mask == 0xff;
+}
+
+/*
+ * Looks up the formats for pictures of the window buffers and of the unlock
+ * indicator. Exits if the X server lacks the Render extension, which cairo
+ * needs as well.
+ *
+ */
+void render_init(xcb_connection_t *conn, xcb_screen_t *screen) {
+    if (root_format != 0) {
+        return;
+    }
+
+    const xcb_query_extension_reply_t *render =
+        xcb_get_extension_data(conn, &xcb_render_id);
+    if (render == NULL || !render->present) {
+        errx(EXIT_FAILURE, "X server does not support the RENDER extension");
+    }
+    /* The version has to be negotiated before any other request. */
+    free(xcb_render_query_version_reply(
+        conn,
+        xcb_render_query_version(conn, XCB_RENDER_MAJOR_VERSION,
+                                 XCB_RENDER_MINOR_VERSION),
+        NULL));
+
+    xcb_render_query_pict_formats_reply_t *formats =
+        xcb_render_query_pict_formats_reply(
+            conn, xcb_render_query_pict_formats(conn), NULL);
+    if (formats == NULL) {
+        errx(EXIT_FAILURE, "Could not query the RENDER picture formats");
+    }
+
+    xcb_render_pictforminfo_t *infos =
+        xcb_render_query_pict_formats_formats(formats);
+    const int infos_len = xcb_render_query_pict_formats_formats_length(formats);
+    bool found_argb32 = false;
+    for (int i = 0; i < infos_len && !found_argb32; i++) {
+        if (is_argb32(&infos[i])) {
+            argb32_format = infos[i];
+            found_argb32 = true;
+        }
+    }
+
+    for (xcb_render_pictscreen_iterator_t screens =
+             xcb_render_query_pict_formats_screens_iterator(formats);
+         screens.rem && root_format == 0;
+         xcb_render_pictscreen_next(&screens)) {
+        for (xcb_render_pictdepth_iterator_t depths =
+                 xcb_render_pictscreen_depths_iterator(screens.data);
+             depths.rem && root_format == 0;
+             xcb_render_pictdepth_next(&depths)) {
+            for (xcb_render_pictvisual_iterator_t visuals =
+                     xcb_render_pictdepth_visuals_iterator(depths.data);
+                 visuals.rem; xcb_render_pictvisual_next(&visuals)) {
+                if (visuals.data->visual == screen->root_visual) {
+                    root_format = visuals.data->format;
+                    break;
+                }
+            }
+        }
+    }
+    free(formats);
+
+    if (!found_argb32 || root_format == 0) {
+        errx(EXIT_FAILURE, "Could not find the RENDER picture formats");
+    }
+    DEBUG("render: root format 0x%08x, ARGB32 format 0x%08x\n", root_format,
+          argb32_format.id);
+}
+
+xcb_render_pictforminfo_t *render_argb32_format(void) {
+    return &argb32_format;
+}
+
+/*
+ * Creates a picture for a pixmap with either the root window's depth and
+ * visual, or 32 bit ARGB.
+ *
+ */
+xcb_render_picture_t render_create_picture(xcb_connection_t *conn,
+                                           xcb_drawable_t drawable,
+                                           bool argb32) {
+    xcb_render_picture_t picture = xcb_generate_id(conn);
+    xcb_render_create_picture(conn, picture, drawable,
+                              argb32 ? argb32_format.id : root_format, 0,
+                              NULL);
+    return picture;
+}
+
+/*
+ * Makes the X server sample picture through a transform which scales it by
+ * 1/scale, with bilinear filtering.
+ *
+ */
+static void set_scale(xcb_connection_t *conn, xcb_render_picture_t picture,
+                      double scale) {
+    const xcb_render_fixed_t s = (xcb_render_fixed_t)(scale * 65536);
+    const xcb_render_fixed_t one = 65536;
+    xcb_render_set_picture_transform(
+        conn, picture,
+        (xcb_render_transform_t){s, 0, 0, 0, s, 0, 0, 0, one});
+    xcb_render_set_picture_filter(conn, picture, strlen("bilinear"),
+                                  "bilinear", 0, NULL);
+}
+
+/*
+ * Returns a new pixmap with a coarse blur of src, which is scaled down by
+ * PREVIEW_SCALE and back up with bilinear filtering. The X server does this in
+ * a few milliseconds, so it can cover the screen while the real blur is
+ * computed.
+ *
+ */
+xcb_pixmap_t render_blur_preview(xcb_connection_t *conn, xcb_screen_t *screen,
+                                 xcb_pixmap_t src, uint16_t width,
+                                 uint16_t height) {
+    render_init(conn, screen);
+
+    const uint16_t small_width = (width + PREVIEW_SCALE - 1) / PREVIEW_SCALE;
+    const uint16_t small_height = (height + PREVIEW_SCALE - 1) / PREVIEW_SCALE;
+    xcb_pixmap_t small = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, screen->root_depth, small, screen->root,
+                      small_width, small_height);
+    xcb_pixmap_t dst = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, screen->root_depth, dst, screen->root, width,
+                      height);
+
+    xcb_render_picture_t src_picture = render_create_picture(conn, src, false);
+    xcb_render_picture_t small_picture =
+        render_create_picture(conn, small, false);
+    xcb_render_picture_t dst_picture = render_create_picture(conn, dst, false);
+
+    set_scale(conn, src_picture, PREVIEW_SCALE);
+    xcb_render_composite(conn, XCB_RENDER_PICT_OP_SRC, src_picture, XCB_NONE,
+                         small_picture, 0, 0, 0, 0, 0, 0, small_width,
+                         small_height);
+
+    /* Without padding, the edges would fade to black when scaling up. */
+    xcb_render_change_picture(conn, small_picture, XCB_RENDER_CP_REPEAT,
+                              (uint32_t[1]){XCB_RENDER_REPEAT_PAD});
+    set_scale(conn, small_picture, 1.0 / PREVIEW_SCALE);
+    xcb_render_composite(conn, XCB_RENDER_PICT_OP_SRC, small_picture,
+                         XCB_NONE, dst_picture, 0, 0, 0, 0, 0, 0, width,
+                         height);
+
+    xcb_render_free_picture(conn, src_picture);
+    xcb_render_free_picture(conn, small_picture);
+    xcb_render_free_picture(conn, dst_picture);
+    xcb_free_pixmap(conn, small);
+    return dst;
+}
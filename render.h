@@ -0,0 +1,17 @@
+#ifndef _RENDER_H
+#define _RENDER_H
+
+#include <stdbool.h>
+#include <xcb/render.h>
+#include <xcb/xcb.h>
+
+void render_init(xcb_connection_t *conn, xcb_screen_t *screen);
+xcb_render_pictforminfo_t *render_argb32_format(void);
+xcb_render_picture_t render_create_picture(xcb_connection_t *conn,
+                                           xcb_drawable_t drawable,
+                                           bool argb32);
+xcb_pixmap_t render_blur_preview(xcb_connection_t *conn, xcb_screen_t *screen,
+                                 xcb_pixmap_t src, uint16_t width,
+                                 uint16_t height);
+
+#endif
@@ -15,13 +15,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/param.h>
+#include <time.h>
 #include <xcb/xcb.h>
+#include <xcb/xcb_aux.h>
 
 #include "blur.h"
+#include "dpms.h"
 #include "i3lock.h"
+#include "present.h"
 #include "unlock_indicator.h"
 #include "xcb.h"
 #include "randr.h"
+#include "render.h"
 
 #define BUTTON_RADIUS 90
 #define BUTTON_SPACE (BUTTON_RADIUS + 5)
@@ -53,13 +59,13 @@ extern char *modifier_string;
 
 /* A Cairo surface containing the specified image (-i), if any. */
 extern cairo_surface_t *img;
-extern bool dpms_capable;
 /* Whether the image should be tiled. */
 extern bool tile;
 /* Whether to use fuzzy mode. */
 extern bool fuzzy;
 extern int blur_radius;
 extern float blur_sigma;
+extern int full_screen_copies;
 /* to blur the screen only once */
 extern bool once;
 /* The background color to use (in hex). */
@@ -90,8 +96,98 @@ static xcb_visualtype_t *vistype;
 unlock_state_t unlock_state;
 auth_state_t auth_state;
 
-/* A surface for the unlock indicator */
+/* A surface for the unlock indicator, and its picture for compositing it onto
+ * the window contents. */
+static xcb_pixmap_t unlock_indicator_pixmap = XCB_NONE;
 static cairo_surface_t *unlock_indicator_surface = NULL;
+static xcb_render_picture_t unlock_indicator_picture = XCB_NONE;
+
+/* The parts of the unlock indicator which do not depend on the text are drawn
+ * once for the current button_diameter_physical and afterwards only
+ * composited: the ring in each of its colors, and the highlight of a keypress
+ * at each of HIGHLIGHT_STEPS angles. Like unlock_indicator_surface, they are
+ * pixmaps on the X server, so compositing them uploads nothing. */
+typedef enum {
+    RING_IDLE = 0,
+    RING_VERIFY = 1,
+    RING_WRONG = 2,
+    RING_KINDS,
+} ring_kind_t;
+
+#define HIGHLIGHT_STEPS 32
+
+typedef struct {
+    cairo_surface_t *surface;
+    /* The position of the sprite within the unlock indicator. */
+    int x;
+    int y;
+} sprite_t;
+
+static cairo_surface_t *ring_sprites[RING_KINDS];
+/* Indexed by whether the highlight is for backspace, and by the angle. */
+static sprite_t highlight_sprites[2][HIGHLIGHT_STEPS];
+
+/* Lines of text drawn on the unlock indicator, most recently used first. Text
+ * is laid out and rendered once per content, size and color, so the status
+ * messages stay in here, as do the last few failed attempt counts and
+ * modifier strings. */
+#define TEXT_CACHE_SIZE 16
+
+typedef struct {
+    char *text;
+    double font_size;
+    bool red;
+    double y_offset;
+    sprite_t sprite;
+} text_sprite_t;
+
+static text_sprite_t text_sprites[TEXT_CACHE_SIZE];
+static int text_sprites_len = 0;
+/* How many lines of text the current draw_unlock_indicator() call found in
+ * text_sprites, and how many it had to render. */
+static int text_hits;
+static int text_misses;
+/* Set by the I3LOCK_NO_TEXT_CACHE environment variable, so that the timing in
+ * the debug output can be compared to rendering every line anew. */
+static bool text_cache_disabled = false;
+
+/* Damage reported since the last frame, in root window coordinates. When more
+ * rectangles come in, they are merged into bounding boxes. */
+#define MAX_DAMAGE_RECTS 16
+static xcb_rectangle_t damage_rects[MAX_DAMAGE_RECTS];
+static int damage_rects_len = 0;
+
+/* The window contents are composed from persistent pixmaps. base_pixmap holds
+ * the background without the unlock indicator, that is the image or color, or
+ * the blurred screen in live fuzzy mode (-f without -1). The two buffers hold
+ * the same with the unlock indicator on top. Each frame is drawn into the
+ * buffer which is not on the screen, and only where it differs from the new
+ * frame: where the background or the unlock indicator changed in this or in
+ * the previous frame. All of them are only reallocated when the screen is
+ * resized. */
+static xcb_pixmap_t base_pixmap = XCB_NONE;
+static xcb_gcontext_t base_gc = XCB_NONE;
+static struct {
+    xcb_pixmap_t pixmap;
+    xcb_render_picture_t picture;
+} buffers[2];
+static int back_buffer = 0;
+/* What the previous frame changed, the back buffer does not have it yet. */
+static xcb_rectangle_t previous_changed[MAX_DAMAGE_RECTS];
+static int previous_changed_len = 0;
+
+/* Live fuzzy mode also keeps the unblurred screen contents, so that only the
+ * parts of the screen which changed need to be captured and blurred again. */
+static xcb_pixmap_t live_capture = XCB_NONE;
+
+
+/* Where the unlock indicators are drawn. */
+static xcb_rectangle_t *indicator_rects = NULL;
+static int indicator_rects_len = 0;
+
+/* Whether redraw_screen() was called while the previous frame was still being
+ * presented. */
+static bool redraw_pending = false;
 
 /*
  * Returns the scaling factor of the current screen. E.g., on a 227 DPI MacBook
@@ -104,15 +200,313 @@ static double scaling_factor(void) {
     return (dpi / 96.0);
 }
 
+/*
+ * Creates an ARGB surface on the X server, to draw parts of the unlock
+ * indicator on. Requires unlock_indicator_surface.
+ *
+ */
+static cairo_surface_t *create_sprite_surface(int width, int height) {
+    return cairo_surface_create_similar(
+        unlock_indicator_surface, CAIRO_CONTENT_COLOR_ALPHA, width, height);
+}
+
+static ring_kind_t get_ring_kind(void) {
+    switch (auth_state) {
+        case STATE_AUTH_VERIFY:
+        case STATE_AUTH_LOCK:
+            return RING_VERIFY;
+        case STATE_AUTH_WRONG:
+        case STATE_I3LOCK_LOCK_FAILED:
+            return RING_WRONG;
+        default:
+            if (unlock_state == STATE_NOTHING_TO_DELETE) {
+                return RING_WRONG;
+            }
+            return RING_IDLE;
+    }
+}
+
+/*
+ * Draws the (centered) circle with transparent background in the colors of
+ * the given PAM state.
+ *
+ */
+static cairo_surface_t *render_ring_sprite(ring_kind_t kind) {
+    cairo_surface_t *surface = create_sprite_surface(button_diameter_physical,
+                                                     button_diameter_physical);
+    cairo_t *ctx = cairo_create(surface);
+    cairo_scale(ctx, scaling_factor(), scaling_factor());
+
+    cairo_set_line_width(ctx, 10.0);
+    cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */, 0 /* start */, 2 * M_PI /* end */);
+
+    /* Use the appropriate color for the different PAM states
+     * (currently verifying, wrong password, or default) */
+    switch (kind) {
+        case RING_VERIFY:
+            cairo_set_source_rgba(ctx, 0, 114.0 / 255, 255.0 / 255, 0.75);
+            cairo_fill_preserve(ctx);
+            cairo_set_source_rgb(ctx, 51.0 / 255, 0, 250.0 / 255);
+            break;
+        case RING_WRONG:
+            cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
+            cairo_fill_preserve(ctx);
+            cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
+            break;
+        default:
+            cairo_set_source_rgba(ctx, 0, 0, 0, 0.75);
+            cairo_fill_preserve(ctx);
+            cairo_set_source_rgb(ctx, 51.0 / 255, 125.0 / 255, 0);
+            break;
+    }
+    cairo_stroke(ctx);
+
+    /* Draw an inner seperator line. */
+    cairo_set_source_rgb(ctx, 0, 0, 0);
+    cairo_set_line_width(ctx, 2.0);
+    cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
+              BUTTON_RADIUS - 5 /* radius */, 0, 2 * M_PI);
+    cairo_stroke(ctx);
+
+    cairo_destroy(ctx);
+    return surface;
+}
+
+static void highlight_path(cairo_t *ctx, double highlight_start) {
+    cairo_new_path(ctx);
+    cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */, highlight_start,
+              highlight_start + (M_PI / 3.0));
+}
+
+/*
+ * Draws the highlighted part of the unlock indicator which confirms a
+ * keypress, starting at the given step of the circle. The sprite only covers
+ * the highlight.
+ *
+ */
+static void render_highlight_sprite(bool backspace, int step) {
+    sprite_t *sprite = &highlight_sprites[backspace][step];
+    const double highlight_start = step * (2 * M_PI / HIGHLIGHT_STEPS);
+    const double scale = scaling_factor();
+
+    /* Find the area the highlight covers, in pixels. */
+    cairo_surface_t *scratch =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *ctx = cairo_create(scratch);
+    cairo_set_line_width(ctx, 10.0);
+    highlight_path(ctx, highlight_start);
+    double x0, y0, x1, y1;
+    cairo_stroke_extents(ctx, &x0, &y0, &x1, &y1);
+    cairo_destroy(ctx);
+    cairo_surface_destroy(scratch);
+    sprite->x = MAX(floor(x0 * scale), 0);
+    sprite->y = MAX(floor(y0 * scale), 0);
+    const int width =
+        MIN(ceil(x1 * scale), (int)button_diameter_physical) - sprite->x;
+    const int height =
+        MIN(ceil(y1 * scale), (int)button_diameter_physical) - sprite->y;
+
+    sprite->surface = create_sprite_surface(width, height);
+    ctx = cairo_create(sprite->surface);
+    cairo_translate(ctx, -sprite->x, -sprite->y);
+    cairo_scale(ctx, scale, scale);
+    cairo_set_line_width(ctx, 10.0);
+    highlight_path(ctx, highlight_start);
+    if (!backspace) {
+        /* For normal keys, we use a lighter green. */
+        cairo_set_source_rgb(ctx, 51.0 / 255, 219.0 / 255, 0);
+    } else {
+        /* For backspace, we use red. */
+        cairo_set_source_rgb(ctx, 219.0 / 255, 51.0 / 255, 0);
+    }
+    cairo_stroke(ctx);
+
+    /* Draw two little separators for the highlighted part of the
+     * unlock indicator. */
+    cairo_set_source_rgb(ctx, 0, 0, 0);
+    cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */, highlight_start /* start */,
+              highlight_start + (M_PI / 128.0) /* end */);
+    cairo_stroke(ctx);
+    cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
+              BUTTON_RADIUS /* radius */,
+              (highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
+              highlight_start + (M_PI / 3.0) /* end */);
+    cairo_stroke(ctx);
+
+    cairo_destroy(ctx);
+}
+
+/*
+ * Draws the rings and highlights for the current diameter ahead of time, so
+ * that no key press has to wait for cairo to draw them.
+ *
+ */
+static void render_sprites(void) {
+    for (int kind = 0; kind < RING_KINDS; kind++) {
+        ring_sprites[kind] = render_ring_sprite(kind);
+    }
+    for (int i = 0; i < 2; i++) {
+        for (int step = 0; step < HIGHLIGHT_STEPS; step++) {
+            render_highlight_sprite(i, step);
+        }
+    }
+}
+
+/*
+ * Renders a line of text, centered horizontally on the unlock indicator and
+ * vertically offset from its center by y_offset, onto a sprite which only
+ * covers the text.
+ *
+ */
+static sprite_t render_text(const char *text, double font_size, bool red,
+                            double y_offset) {
+    const double scale = scaling_factor();
+    cairo_surface_t *scratch =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+    cairo_t *ctx = cairo_create(scratch);
+    cairo_scale(ctx, scale, scale);
+    cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL,
+                           CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(ctx, font_size);
+
+    cairo_text_extents_t extents;
+    cairo_text_extents(ctx, text, &extents);
+    const double x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
+    const double y =
+        BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) + y_offset;
+    cairo_destroy(ctx);
+    cairo_surface_destroy(scratch);
+
+    /* The area the text covers in pixels, with a pixel to spare for
+     * antialiasing. */
+    const int x0 = floor((x + extents.x_bearing) * scale) - 1;
+    const int y0 = floor((y + extents.y_bearing) * scale) - 1;
+    const int x1 = ceil((x + extents.x_bearing + extents.width) * scale) + 1;
+    const int y1 = ceil((y + extents.y_bearing + extents.height) * scale) + 1;
+
+    sprite_t sprite = {
+        .surface = create_sprite_surface(x1 - x0, y1 - y0),
+        .x = x0,
+        .y = y0,
+    };
+    ctx = cairo_create(sprite.surface);
+    cairo_translate(ctx, -x0, -y0);
+    cairo_scale(ctx, scale, scale);
+    cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL,
+                           CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size(ctx, font_size);
+    if (red) {
+        cairo_set_source_rgb(ctx, 1, 0, 0);
+    } else {
+        cairo_set_source_rgb(ctx, 0, 0, 0);
+    }
+    cairo_move_to(ctx, x, y);
+    cairo_show_text(ctx, text);
+    cairo_destroy(ctx);
+    return sprite;
+}
+
+/*
+ * Returns the sprite for a line of text from the cache, rendering it if it is
+ * not in there.
+ *
+ */
+static sprite_t get_text_sprite(const char *text, double font_size, bool red,
+                                double y_offset) {
+    text_sprite_t entry;
+    int i;
+    for (i = 0; i < text_sprites_len && !text_cache_disabled; i++) {
+        const text_sprite_t *cached = &text_sprites[i];
+        if (cached->font_size == font_size && cached->red == red &&
+            cached->y_offset == y_offset && strcmp(cached->text, text) == 0) {
+            break;
+        }
+    }
+
+    if (i < text_sprites_len) {
+        text_hits++;
+        entry = text_sprites[i];
+    } else {
+        text_misses++;
+        if (text_sprites_len == TEXT_CACHE_SIZE) {
+            /* Make room by dropping the least recently used line. */
+            i = --text_sprites_len;
+            free(text_sprites[i].text);
+            cairo_surface_destroy(text_sprites[i].sprite.surface);
+        } else {
+            i = text_sprites_len;
+        }
+        entry = (text_sprite_t){
+            .text = strdup(text),
+            .font_size = font_size,
+            .red = red,
+            .y_offset = y_offset,
+            .sprite = render_text(text, font_size, red, y_offset),
+        };
+        text_sprites_len++;
+    }
+
+    /* Move the entry to the front. */
+    memmove(&text_sprites[1], &text_sprites[0], i * sizeof(text_sprite_t));
+    text_sprites[0] = entry;
+    return entry.sprite;
+}
+
+static void draw_text(cairo_t *ctx, const char *text, double font_size,
+                      bool red, double y_offset) {
+    const sprite_t sprite = get_text_sprite(text, font_size, red, y_offset);
+    cairo_set_source_surface(ctx, sprite.surface, sprite.x, sprite.y);
+    cairo_paint(ctx);
+}
+
+static void free_sprites(void) {
+    for (int i = 0; i < RING_KINDS; i++) {
+        cairo_surface_destroy(ring_sprites[i]);
+        ring_sprites[i] = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        for (int step = 0; step < HIGHLIGHT_STEPS; step++) {
+            cairo_surface_destroy(highlight_sprites[i][step].surface);
+            highlight_sprites[i][step].surface = NULL;
+        }
+    }
+    for (int i = 0; i < text_sprites_len; i++) {
+        free(text_sprites[i].text);
+        cairo_surface_destroy(text_sprites[i].sprite.surface);
+    }
+    text_sprites_len = 0;
+}
+
 static void draw_unlock_indicator() {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    text_hits = 0;
+    text_misses = 0;
+
     /* Initialise the surface if not yet done */
     if (unlock_indicator_surface == NULL) {
         button_diameter_physical = ceil(scaling_factor() * BUTTON_DIAMETER);
         DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
               scaling_factor(), button_diameter_physical);
-        unlock_indicator_surface = cairo_image_surface_create(
-            CAIRO_FORMAT_ARGB32, button_diameter_physical,
-            button_diameter_physical);
+        render_init(conn, screen);
+        unlock_indicator_pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, 32, unlock_indicator_pixmap, screen->root,
+                          button_diameter_physical, button_diameter_physical);
+        unlock_indicator_surface = cairo_xcb_surface_create_with_xrender_format(
+            conn, screen, unlock_indicator_pixmap, render_argb32_format(),
+            button_diameter_physical, button_diameter_physical);
+        unlock_indicator_picture =
+            render_create_picture(conn, unlock_indicator_pixmap, true);
+        if (unlock_indicator) {
+            render_sprites();
+        }
+        text_cache_disabled = getenv("I3LOCK_NO_TEXT_CACHE") != NULL;
+        if (text_cache_disabled) {
+            DEBUG("text cache disabled\n");
+        }
     }
 
     cairo_t *ctx = cairo_create(unlock_indicator_surface);
@@ -124,71 +518,16 @@ static void draw_unlock_indicator() {
 
     if (unlock_indicator &&
         (unlock_state >= STATE_KEY_PRESSED || auth_state > STATE_AUTH_IDLE)) {
-        cairo_scale(ctx, scaling_factor(), scaling_factor());
-        /* Draw a (centered) circle with transparent background. */
-        cairo_set_line_width(ctx, 10.0);
-        cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
-                  BUTTON_RADIUS /* radius */, 0 /* start */,
-                  2 * M_PI /* end */);
-
-        /* Use the appropriate color for the different PAM states
-         * (currently verifying, wrong password, or default) */
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgba(ctx, 0, 114.0 / 255, 255.0 / 255, 0.75);
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
-                cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
-                break;
-            default:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgba(ctx, 250.0 / 255, 0, 0, 0.75);
-                    break;
-                }
-                cairo_set_source_rgba(ctx, 0, 0, 0, 0.75);
-                break;
-        }
-        cairo_fill_preserve(ctx);
-
-        switch (auth_state) {
-            case STATE_AUTH_VERIFY:
-            case STATE_AUTH_LOCK:
-                cairo_set_source_rgb(ctx, 51.0 / 255, 0, 250.0 / 255);
-                break;
-            case STATE_AUTH_WRONG:
-            case STATE_I3LOCK_LOCK_FAILED:
-                cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
-                break;
-            case STATE_AUTH_IDLE:
-                if (unlock_state == STATE_NOTHING_TO_DELETE) {
-                    cairo_set_source_rgb(ctx, 125.0 / 255, 51.0 / 255, 0);
-                    break;
-                }
-
-                cairo_set_source_rgb(ctx, 51.0 / 255, 125.0 / 255, 0);
-                break;
-        }
-        cairo_stroke(ctx);
-
-        /* Draw an inner seperator line. */
-        cairo_set_source_rgb(ctx, 0, 0, 0);
-        cairo_set_line_width(ctx, 2.0);
-        cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
-                  BUTTON_RADIUS - 5 /* radius */, 0, 2 * M_PI);
-        cairo_stroke(ctx);
-
-        cairo_set_line_width(ctx, 10.0);
+        cairo_set_source_surface(ctx, ring_sprites[get_ring_kind()], 0, 0);
+        cairo_paint(ctx);
 
         /* Display a (centered) text of the current PAM state. */
         char *text = NULL;
         /* We don't want to show more than a 3-digit number. */
         char buf[4];
+        double font_size = 28.0;
+        bool red = false;
 
-        cairo_set_source_rgb(ctx, 0, 0, 0);
-        cairo_select_font_face(ctx, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(ctx, 28.0);
         switch (auth_state) {
             case STATE_AUTH_VERIFY:
                 text = "verifying…";
@@ -213,39 +552,18 @@ static void draw_unlock_indicator() {
                         snprintf(buf, sizeof(buf), "%d", failed_attempts);
                         text = buf;
                     }
-                    cairo_set_source_rgb(ctx, 1, 0, 0);
-                    cairo_set_font_size(ctx, 32.0);
+                    red = true;
+                    font_size = 32.0;
                 }
                 break;
         }
 
         if (text) {
-            cairo_text_extents_t extents;
-            double x, y;
-
-            cairo_text_extents(ctx, text, &extents);
-            x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-            y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing);
-
-            cairo_move_to(ctx, x, y);
-            cairo_show_text(ctx, text);
-            cairo_close_path(ctx);
+            draw_text(ctx, text, font_size, red, 0);
         }
 
         if (auth_state == STATE_AUTH_WRONG && (modifier_string != NULL)) {
-            cairo_text_extents_t extents;
-            double x, y;
-
-            cairo_set_font_size(ctx, 14.0);
-
-            cairo_text_extents(ctx, modifier_string, &extents);
-            x = BUTTON_CENTER - ((extents.width / 2) + extents.x_bearing);
-            y = BUTTON_CENTER - ((extents.height / 2) + extents.y_bearing) +
-                28.0;
-
-            cairo_move_to(ctx, x, y);
-            cairo_show_text(ctx, modifier_string);
-            cairo_close_path(ctx);
+            draw_text(ctx, modifier_string, 14.0, false, 28.0);
         }
 
         /* After the user pressed any valid key or the backspace key, we
@@ -253,76 +571,167 @@ static void draw_unlock_indicator() {
          * keypress. */
         if (unlock_state == STATE_KEY_ACTIVE ||
             unlock_state == STATE_BACKSPACE_ACTIVE) {
-            cairo_new_sub_path(ctx);
-            double highlight_start = (rand() % (int)(2 * M_PI * 100)) / 100.0;
-            cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */, highlight_start,
-                      highlight_start + (M_PI / 3.0));
-            if (unlock_state == STATE_KEY_ACTIVE) {
-                /* For normal keys, we use a lighter green. */
-                cairo_set_source_rgb(ctx, 51.0 / 255, 219.0 / 255, 0);
-            } else {
-                /* For backspace, we use red. */
-                cairo_set_source_rgb(ctx, 219.0 / 255, 51.0 / 255, 0);
-            }
-            cairo_stroke(ctx);
-
-            /* Draw two little separators for the highlighted part of the
-             * unlock indicator. */
-            cairo_set_source_rgb(ctx, 0, 0, 0);
-            cairo_arc(ctx, BUTTON_CENTER /* x */, BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */, highlight_start /* start */,
-                      highlight_start + (M_PI / 128.0) /* end */);
-            cairo_stroke(ctx);
-            cairo_arc(ctx,
-                      BUTTON_CENTER /* x */,
-                      BUTTON_CENTER /* y */,
-                      BUTTON_RADIUS /* radius */,
-                      (highlight_start + (M_PI / 3.0)) - (M_PI / 128.0) /* start */,
-                      highlight_start + (M_PI / 3.0) /* end */);
-            cairo_stroke(ctx);
+            const sprite_t highlight =
+                highlight_sprites[unlock_state == STATE_BACKSPACE_ACTIVE]
+                                 [rand() % HIGHLIGHT_STEPS];
+            cairo_set_source_surface(ctx, highlight.surface, highlight.x,
+                                     highlight.y);
+            cairo_paint(ctx);
         }
     }
 
     cairo_destroy(ctx);
+    /* Composited without cairo from here on. */
+    cairo_surface_flush(unlock_indicator_surface);
+    if (debug_mode) {
+        /* Include the time the X server takes to render the text. */
+        xcb_aux_sync(conn);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    DEBUG("draw_unlock_indicator: %.3f ms, %d cached and %d new lines of "
+          "text\n",
+          (end.tv_sec - start.tv_sec) * 1e3 +
+              (end.tv_nsec - start.tv_nsec) / 1e6,
+          text_hits, text_misses);
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Returns the number of unlock indicators and stores where they go in rects,
+ * which the caller has to free.
  *
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
+static int get_indicator_rects(xcb_rectangle_t **rects) {
+    const int len = (xr_screens > 0) ? xr_screens : 1;
+    *rects = calloc(len, sizeof(xcb_rectangle_t));
+    if (*rects == NULL) {
+        return 0;
+    }
+
+    for (int screen = 0; screen < len; screen++) {
+        int x, y;
+        if (xr_screens > 0) {
+            /* Composite the unlock indicator in the middle of each screen. */
+            x = (xr_resolutions[screen].x +
+                 ((xr_resolutions[screen].width / 2) -
+                  (button_diameter_physical / 2)));
+            y = (xr_resolutions[screen].y +
+                 ((xr_resolutions[screen].height / 2) -
+                  (button_diameter_physical / 2)));
+        } else {
+            /* We have no information about the screen sizes/positions, so we
+             * just place the unlock indicator in the middle of the X root
+             * window and hope for the best. */
+            x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
+            y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
+        }
+        (*rects)[screen] = (xcb_rectangle_t){x, y, button_diameter_physical,
+                                             button_diameter_physical};
+    }
+    return len;
+}
+
+static void draw_indicators(xcb_render_picture_t picture,
+                            const xcb_rectangle_t *rects, int len) {
+    if (unlock_indicator_picture == XCB_NONE) {
+        return;
+    }
+    for (int i = 0; i < len; i++) {
+        xcb_render_composite(conn, XCB_RENDER_PICT_OP_OVER,
+                             unlock_indicator_picture, XCB_NONE, picture, 0, 0,
+                             0, 0, rects[i].x, rects[i].y, rects[i].width,
+                             rects[i].height);
+    }
+}
+
+/*
+ * Clips the given rectangle, grown by margin on each side, to the screen.
+ * Returns false if nothing of it is left.
+ *
+ */
+static bool clip_rect(xcb_rectangle_t *rect, int margin) {
+    const int x0 = MAX(rect->x - margin, 0);
+    const int y0 = MAX(rect->y - margin, 0);
+    const int x1 = MIN(rect->x + rect->width + margin, (int)last_resolution[0]);
+    const int y1 =
+        MIN(rect->y + rect->height + margin, (int)last_resolution[1]);
+    if (x0 >= x1 || y0 >= y1) {
+        return false;
+    }
+    *rect = (xcb_rectangle_t){x0, y0, x1 - x0, y1 - y0};
+    return true;
+}
+
+static bool rects_overlap(xcb_rectangle_t a, xcb_rectangle_t b) {
+    return a.x < b.x + b.width && b.x < a.x + a.width &&
+           a.y < b.y + b.height && b.y < a.y + a.height;
+}
+
+static xcb_rectangle_t bounding_box(xcb_rectangle_t a, xcb_rectangle_t b) {
+    const int x0 = MIN(a.x, b.x);
+    const int y0 = MIN(a.y, b.y);
+    const int x1 = MAX(a.x + a.width, b.x + b.width);
+    const int y1 = MAX(a.y + a.height, b.y + b.height);
+    return (xcb_rectangle_t){x0, y0, x1 - x0, y1 - y0};
+}
+
+/*
+ * Adds rect to the list of at most MAX_DAMAGE_RECTS rectangles, so that no two
+ * of them overlap. Overlapping rectangles are replaced by their bounding box,
+ * which is cheaper than blurring the overlap twice.
+ *
+ */
+static void add_rect(xcb_rectangle_t *rects, int *len, xcb_rectangle_t rect) {
+    for (int i = 0; i < *len; i++) {
+        if (rects_overlap(rects[i], rect) || *len == MAX_DAMAGE_RECTS) {
+            /* The bounding box may overlap others, so start over. */
+            rect = bounding_box(rects[i], rect);
+            rects[i] = rects[--(*len)];
+            i = -1;
+        }
+    }
+    rects[(*len)++] = rect;
+}
+
+/*
+ * Records that the given area of the screen changed. It is captured and
+ * blurred again on the next redraw_screen() in live fuzzy mode.
+ *
+ */
+void add_damage(xcb_rectangle_t area) {
+    if (clip_rect(&area, 0)) {
+        add_rect(damage_rects, &damage_rects_len, area);
+    }
+}
+
+/*
+ * Paints the image or color, or the screen contents in fuzzy mode, onto a new
+ * pixmap with the given resolution and returns it.
+ *
+ */
+static xcb_pixmap_t draw_background(uint32_t *resolution) {
     xcb_pixmap_t bg_pixmap = XCB_NONE;
 
     if (!vistype)
         vistype = get_root_visual_type(screen);
-    if (fuzzy) {
-        bg_pixmap = create_fg_pixmap(conn, screen, resolution);
-    } else {
-        bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
+    if (fuzzy && img == NULL) {
+        /* Nothing else is drawn over the captured screen. */
+        return create_fg_pixmap(conn, screen, resolution);
     }
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
+    /* In once fuzzy mode, img is the blurred screen, so there is no need to
+     * capture the screen again. */
+    bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
 
     cairo_surface_t *xcb_output = cairo_xcb_surface_create(
         conn, bg_pixmap, vistype, resolution[0], resolution[1]);
     cairo_t *xcb_ctx = cairo_create(xcb_output);
 
-    if (img || fuzzy) {
-        if (fuzzy && !once) {
-            blur_image_gl(0, bg_pixmap, last_resolution[0], last_resolution[1],
-                          blur_radius, blur_sigma);
-            cairo_surface_t *tmp = cairo_xcb_surface_create(
-                conn, bg_pixmap, get_root_visual_type(screen),
-                last_resolution[0], last_resolution[1]);
-            cairo_set_source_surface(xcb_ctx, tmp, 0, 0);
-            cairo_paint(xcb_ctx);
-            cairo_surface_destroy(tmp);
-        } else if (!tile) {
+    if (img) {
+        if (!tile) {
             cairo_set_source_surface(xcb_ctx, img, 0, 0);
             cairo_paint(xcb_ctx);
+            full_screen_copies++;
         } else {
             /* create a pattern and fill a rectangle as big as the screen */
             cairo_pattern_t *pattern;
@@ -332,6 +741,7 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
             cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
             cairo_fill(xcb_ctx);
             cairo_pattern_destroy(pattern);
+            full_screen_copies++;
         }
     } else {
         char strgroups[3][3] = {{color[0], color[1], '\0'},
@@ -344,73 +754,236 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
                              rgb16[2] / 255.0);
         cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
         cairo_fill(xcb_ctx);
+        full_screen_copies++;
     }
 
-    if (xr_screens > 0) {
-        /* Composite the unlock indicator in the middle of each screen. */
-        for (int screen = 0; screen < xr_screens; screen++) {
-            int x = (xr_resolutions[screen].x +
-                     ((xr_resolutions[screen].width / 2) -
-                      (button_diameter_physical / 2)));
-            int y = (xr_resolutions[screen].y +
-                     ((xr_resolutions[screen].height / 2) -
-                      (button_diameter_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, unlock_indicator_surface, x, y);
-            cairo_rectangle(xcb_ctx, x, y, button_diameter_physical,
-                            button_diameter_physical);
-            cairo_fill(xcb_ctx);
+    cairo_surface_destroy(xcb_output);
+    cairo_destroy(xcb_ctx);
+    return bg_pixmap;
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it.
+ *
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    xcb_pixmap_t bg_pixmap = draw_background(resolution);
+
+    /* Composite the unlock indicator onto it, once per screen. */
+    if (unlock_indicator_picture != XCB_NONE) {
+        xcb_render_picture_t picture =
+            render_create_picture(conn, bg_pixmap, false);
+        xcb_rectangle_t *rects;
+        const int rects_len = get_indicator_rects(&rects);
+        draw_indicators(picture, rects, rects_len);
+        free(rects);
+        xcb_render_free_picture(conn, picture);
+    }
+    return bg_pixmap;
+}
+
+static void free_window_pixmaps(void) {
+    if (base_pixmap == XCB_NONE) {
+        return;
+    }
+    if (live_capture != XCB_NONE) {
+        blur_release_pixmap(live_capture);
+        xcb_free_pixmap(conn, live_capture);
+        live_capture = XCB_NONE;
+    }
+    blur_release_pixmap(base_pixmap);
+    xcb_free_pixmap(conn, base_pixmap);
+    xcb_free_gc(conn, base_gc);
+    base_pixmap = XCB_NONE;
+    for (int i = 0; i < 2; i++) {
+        xcb_render_free_picture(conn, buffers[i].picture);
+        xcb_free_pixmap(conn, buffers[i].pixmap);
+    }
+}
+
+/*
+ * Creates base_pixmap and the buffers for the current resolution.
+ *
+ */
+static void create_window_pixmaps(void) {
+    const int width = last_resolution[0];
+    const int height = last_resolution[1];
+
+    if (fuzzy && !once) {
+        live_capture = create_fg_pixmap(conn, screen, last_resolution);
+        base_pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, screen->root_depth, base_pixmap, screen->root,
+                          width, height);
+        const XRectangle area = {0, 0, width, height};
+        blur_image_region(0, live_capture, base_pixmap, width, height, area,
+                          blur_radius, blur_sigma);
+    } else {
+        base_pixmap = draw_background(last_resolution);
+    }
+    base_gc = xcb_generate_id(conn);
+    xcb_create_gc(conn, base_gc, base_pixmap, 0, NULL);
+
+    render_init(conn, screen);
+    for (int i = 0; i < 2; i++) {
+        buffers[i].pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, screen->root_depth, buffers[i].pixmap,
+                          screen->root, width, height);
+        buffers[i].picture =
+            render_create_picture(conn, buffers[i].pixmap, false);
+    }
+
+    /* Neither buffer has anything yet. */
+    previous_changed[0] = (xcb_rectangle_t){0, 0, width, height};
+    previous_changed_len = 1;
+}
+
+/*
+ * Captures the damaged parts of the screen again and blurs them into
+ * base_pixmap, together with the pixels as far around them as the blur
+ * reaches. Adds the parts of base_pixmap which changed to dirty.
+ *
+ */
+static void update_live_base(xcb_rectangle_t *dirty, int *dirty_len) {
+    const int width = last_resolution[0];
+    const int height = last_resolution[1];
+    const int reach = blur_reach(blur_radius, blur_sigma, width, height);
+    xcb_rectangle_t blurred[MAX_DAMAGE_RECTS];
+    int blurred_len = 0;
+
+    for (int i = 0; i < damage_rects_len; i++) {
+        xcb_rectangle_t rect = damage_rects[i];
+        capture_screen(conn, screen, live_capture, rect);
+        if (clip_rect(&rect, reach)) {
+            add_rect(blurred, &blurred_len, rect);
         }
+    }
+    for (int i = 0; i < blurred_len; i++) {
+        const XRectangle area = {blurred[i].x, blurred[i].y, blurred[i].width,
+                                 blurred[i].height};
+        blur_image_region(0, live_capture, base_pixmap, width, height, area,
+                          blur_radius, blur_sigma);
+        add_rect(dirty, dirty_len, blurred[i]);
+    }
+}
+
+/*
+ * Draws the next frame into the back buffer and puts it on the screen.
+ * Everything is drawn only on the first call and after a resize.
+ *
+ */
+static void update_window(void) {
+    const int width = last_resolution[0];
+    const int height = last_resolution[1];
+    /* What differs between the last frame and this one. */
+    xcb_rectangle_t changed[MAX_DAMAGE_RECTS];
+    int changed_len = 0;
+
+    if (base_pixmap == XCB_NONE) {
+        create_window_pixmaps();
+        changed[changed_len++] = (xcb_rectangle_t){0, 0, width, height};
+    } else if (live_capture != XCB_NONE) {
+        update_live_base(changed, &changed_len);
+    }
+    damage_rects_len = 0;
+
+    /* The unlock indicator moves away from where it was, e.g. after a screen
+     * configuration change, or is drawn with new contents. */
+    for (int i = 0; i < indicator_rects_len; i++) {
+        xcb_rectangle_t rect = indicator_rects[i];
+        if (clip_rect(&rect, 0)) {
+            add_rect(changed, &changed_len, rect);
+        }
+    }
+    free(indicator_rects);
+    indicator_rects_len = get_indicator_rects(&indicator_rects);
+    for (int i = 0; i < indicator_rects_len; i++) {
+        xcb_rectangle_t rect = indicator_rects[i];
+        if (clip_rect(&rect, 0)) {
+            add_rect(changed, &changed_len, rect);
+        }
+    }
+
+    /* The back buffer shows the frame before the last one, so the changes of
+     * the last frame have to be redone as well. Restore the background there,
+     * then draw the unlock indicator again. */
+    xcb_rectangle_t redraw[MAX_DAMAGE_RECTS];
+    int redraw_len = 0;
+    for (int i = 0; i < previous_changed_len; i++) {
+        add_rect(redraw, &redraw_len, previous_changed[i]);
+    }
+    for (int i = 0; i < changed_len; i++) {
+        add_rect(redraw, &redraw_len, changed[i]);
+    }
+    const xcb_pixmap_t back = buffers[back_buffer].pixmap;
+    for (int i = 0; i < redraw_len; i++) {
+        xcb_copy_area(conn, base_pixmap, back, base_gc, redraw[i].x,
+                      redraw[i].y, redraw[i].x, redraw[i].y, redraw[i].width,
+                      redraw[i].height);
+        if (redraw[i].width == width && redraw[i].height == height) {
+            full_screen_copies++;
+        }
+    }
+    draw_indicators(buffers[back_buffer].picture, indicator_rects,
+                    indicator_rects_len);
+
+    /* Put the back buffer on the screen, in sync with the display if the X
+     * server supports Present. It also becomes the window background, which
+     * repaints exposed parts of the window. */
+    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP,
+                                 (uint32_t[1]){back});
+    if (present_available()) {
+        present_frame(conn, back, changed, changed_len);
     } else {
-        /* We have no information about the screen sizes/positions, so we just
-         * place the unlock indicator in the middle of the X root window and
-         * hope for the best. */
-        int x = (last_resolution[0] / 2) - (button_diameter_physical / 2);
-        int y = (last_resolution[1] / 2) - (button_diameter_physical / 2);
-        cairo_set_source_surface(xcb_ctx, unlock_indicator_surface, x, y);
-        cairo_rectangle(xcb_ctx, x, y, button_diameter_physical,
-                        button_diameter_physical);
-        cairo_fill(xcb_ctx);
+        for (int i = 0; i < changed_len; i++) {
+            xcb_clear_area(conn, 0, win, changed[i].x, changed[i].y,
+                           changed[i].width, changed[i].height);
+        }
     }
 
-    cairo_surface_destroy(xcb_output);
-    cairo_destroy(xcb_ctx);
-    return bg_pixmap;
+    memcpy(previous_changed, changed, changed_len * sizeof(xcb_rectangle_t));
+    previous_changed_len = changed_len;
+    back_buffer = !back_buffer;
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Updates the window after the unlock indicator, the screen contents in live
+ * mode or the resolution changed.
  *
  */
 void redraw_screen(void) {
     /* avoid drawing if monitor state is not on */
-    if (dpms_capable) {
-        xcb_dpms_info_reply_t *dpms_info =
-            xcb_dpms_info_reply(conn, xcb_dpms_info(conn), NULL);
-        if (dpms_info) {
-            /* monitor is off when DPMS state is enabled and power level is not
-             * DPMS_MODE_ON */
-            uint8_t monitor_off =
-                dpms_info->state &&
-                dpms_info->power_level != XCB_DPMS_DPMS_MODE_ON;
-            free(dpms_info);
-            if (monitor_off)
-                return;
-        }
+    if (dpms_monitor_off())
+        return;
+
+    if (present_busy()) {
+        /* Drawn by redraw_deferred() once the frame in flight is on the
+         * screen. */
+        redraw_pending = true;
+        return;
     }
+    redraw_pending = false;
 
     DEBUG("redraw_screen(unlock_state = %d, auth_state = %d)\n", unlock_state, auth_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP,
-                                 (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    if (!once) {
-        xcb_free_pixmap(conn, bg_pixmap);
-    }
+    full_screen_copies = 0;
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+    update_window();
+    DEBUG("redraw_screen: %d full-screen copies\n", full_screen_copies);
     xcb_flush(conn);
 }
 
+/*
+ * Draws the frame held back by redraw_screen() while the previous one was
+ * being presented.
+ *
+ */
+void redraw_deferred(void) {
+    if (redraw_pending) {
+        redraw_screen();
+    }
+}
+
 /*
  * Redraws screen and also redraws unlock indicator
  *
@@ -438,6 +1011,15 @@ void clear_indicator(void) {
  */
 
 void resize_screen(void) {
-    cairo_surface_destroy(unlock_indicator_surface);
-    unlock_indicator_surface = NULL;
+    if (unlock_indicator_surface != NULL) {
+        cairo_surface_destroy(unlock_indicator_surface);
+        unlock_indicator_surface = NULL;
+        xcb_render_free_picture(conn, unlock_indicator_picture);
+        unlock_indicator_picture = XCB_NONE;
+        xcb_free_pixmap(conn, unlock_indicator_pixmap);
+    }
+    /* The scaling factor may have changed. */
+    free_sprites();
+    /* The background and buffers are recreated by the next redraw. */
+    free_window_pixmaps();
 }
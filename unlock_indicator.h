@@ -21,8 +21,10 @@ typedef enum {
 
 xcb_pixmap_t draw_image(uint32_t* resolution);
 void redraw_screen(void);
+void redraw_deferred(void);
 void redraw_unlock_indicator(void);
 void clear_indicator(void);
 void resize_screen(void);
+void add_damage(xcb_rectangle_t area);
 
 #endif
@@ -0,0 +1,359 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * window_table.c: Keeps track of the top-level windows, their geometry and
+ *                 stacking order, from the events the root window reports
+ *                 with SubstructureNotify. Capturing the screen then needs no
+ *                 round trips to the X server.
+ *
+ */
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcb/composite.h>
+#include <xcb/xcb.h>
+
+#include "i3lock.h"
+#include "window_table.h"
+
+extern bool debug_mode;
+
+/* The top-level windows in stacking order, bottom first. */
+window_t *windows = NULL;
+int windows_len = 0;
+
+static int windows_size = 0;
+static xcb_window_t root = XCB_NONE;
+/* Whether the top-level windows are redirected, which is required for naming
+ * their pixmaps. */
+static bool name_pixmaps = false;
+
+static int index_of(xcb_window_t id) {
+    for (int i = 0; i < windows_len; i++) {
+        if (windows[i].id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+window_t *window_table_find(xcb_window_t id) {
+    const int i = index_of(id);
+    return (i < 0) ? NULL : &windows[i];
+}
+
+/*
+ * Inserts window at the given stacking position and returns it.
+ *
+ */
+static window_t *insert_at(int index, const window_t *window) {
+    if (windows_len == windows_size) {
+        windows_size = (windows_size == 0) ? 64 : 2 * windows_size;
+        windows = realloc(windows, windows_size * sizeof(window_t));
+        if (windows == NULL) {
+            err(EXIT_FAILURE, "Could not allocate memory");
+        }
+    }
+    memmove(&windows[index + 1], &windows[index],
+            (windows_len - index) * sizeof(window_t));
+    windows[index] = *window;
+    windows_len++;
+    return &windows[index];
+}
+
+static void discard_pending(xcb_connection_t *conn, window_t *window) {
+    if (window->pending) {
+        xcb_discard_reply(conn, window->attributes_cookie.sequence);
+        if (window->geometry_cookie.sequence != 0) {
+            xcb_discard_reply(conn, window->geometry_cookie.sequence);
+        }
+        window->pending = false;
+    }
+}
+
+/*
+ * Frees the named pixmap of the window. Its contents no longer follow the
+ * window once it is unmapped, and resizing the window allocates a new one.
+ *
+ */
+static void release_pixmap(xcb_connection_t *conn, window_t *window) {
+    if (window->pixmap != XCB_NONE) {
+        xcb_free_pixmap(conn, window->pixmap);
+        window->pixmap = XCB_NONE;
+    }
+}
+
+static void remove_at(xcb_connection_t *conn, int index) {
+    discard_pending(conn, &windows[index]);
+    release_pixmap(conn, &windows[index]);
+    memmove(&windows[index], &windows[index + 1],
+            (windows_len - index - 1) * sizeof(window_t));
+    windows_len--;
+}
+
+/*
+ * Moves the window at index to a new stacking position, given as an index
+ * into the table without that window.
+ *
+ */
+static void restack(int index, int position) {
+    const window_t window = windows[index];
+    memmove(&windows[index], &windows[index + 1],
+            (windows_len - index - 1) * sizeof(window_t));
+    memmove(&windows[position + 1], &windows[position],
+            (windows_len - 1 - position) * sizeof(window_t));
+    windows[position] = window;
+}
+
+static void set_geometry(window_t *window, int16_t x, int16_t y,
+                         uint16_t width, uint16_t height,
+                         uint16_t border_width) {
+    window->geometry = (xcb_rectangle_t){x + border_width, y + border_width,
+                                         width, height};
+    window->border_width = border_width;
+}
+
+/*
+ * Adds a window which appeared on the root window on top of the others. Its
+ * class, and its geometry unless known, are requested from the X server, but
+ * only read by resolve() once they are needed.
+ *
+ */
+static window_t *add_window(xcb_connection_t *conn, xcb_window_t id,
+                            bool request_geometry) {
+    window_t window = {
+        .id = id,
+        .pending = true,
+        .attributes_cookie = xcb_get_window_attributes(conn, id),
+    };
+    if (request_geometry) {
+        window.geometry_cookie = xcb_get_geometry(conn, id);
+    }
+    return insert_at(windows_len, &window);
+}
+
+/*
+ * Reads the replies to the requests sent by add_window(). This happens when
+ * the window is mapped, so that windows which are created and destroyed
+ * without ever being shown cost no round trip. The map state in the reply is
+ * only used if read_map_state is set, otherwise MapNotify and UnmapNotify are
+ * more recent.
+ *
+ */
+static void resolve(xcb_connection_t *conn, window_t *window,
+                    bool read_map_state) {
+    if (!window->pending) {
+        return;
+    }
+    window->pending = false;
+
+    xcb_get_window_attributes_reply_t *attributes =
+        xcb_get_window_attributes_reply(conn, window->attributes_cookie, NULL);
+    /* If attributes are NULL then the window was destroyed, the table entry
+     * is removed by the DestroyNotify. */
+    window->input_only =
+        attributes == NULL ||
+        attributes->_class == XCB_WINDOW_CLASS_INPUT_ONLY;
+    if (read_map_state) {
+        window->mapped = attributes != NULL &&
+                         attributes->map_state != XCB_MAP_STATE_UNMAPPED;
+    }
+    free(attributes);
+
+    if (window->geometry_cookie.sequence != 0) {
+        xcb_get_geometry_reply_t *geometry =
+            xcb_get_geometry_reply(conn, window->geometry_cookie, NULL);
+        if (geometry != NULL) {
+            set_geometry(window, geometry->x, geometry->y, geometry->width,
+                         geometry->height, geometry->border_width);
+        }
+        free(geometry);
+        window->geometry_cookie.sequence = 0;
+    }
+}
+
+/*
+ * Fills the table with the current children of the root window. Afterwards it
+ * is kept up to date by window_table_handle_event(), which requires root to
+ * select SubstructureNotify before this is called.
+ *
+ */
+void window_table_init(xcb_connection_t *conn, xcb_window_t root_window) {
+    if (root != XCB_NONE) {
+        return;
+    }
+    root = root_window;
+
+    xcb_query_tree_reply_t *reply =
+        xcb_query_tree_reply(conn, xcb_query_tree(conn, root), NULL);
+    if (reply == NULL) {
+        return;
+    }
+    xcb_window_t *children = xcb_query_tree_children(reply);
+    for (int i = 0; i < reply->children_len; ++i) {
+        add_window(conn, children[i], true);
+    }
+    free(reply);
+
+    for (int i = 0; i < windows_len; i++) {
+        resolve(conn, &windows[i], true);
+    }
+    DEBUG("window table: %d top-level windows\n", windows_len);
+}
+
+/*
+ * Empties the table and frees the named pixmaps, for when the root window no
+ * longer reports SubstructureNotify. window_table_init() fills it again.
+ *
+ */
+void window_table_free(xcb_connection_t *conn) {
+    while (windows_len > 0) {
+        remove_at(conn, windows_len - 1);
+    }
+    root = XCB_NONE;
+    name_pixmaps = false;
+}
+
+/*
+ * Updates the table for create, destroy, configure, map, unmap, reparent and
+ * circulate events on the root window. Other events are ignored.
+ *
+ */
+void window_table_handle_event(xcb_connection_t *conn,
+                               const xcb_generic_event_t *event) {
+    if (root == XCB_NONE) {
+        return;
+    }
+
+    switch (event->response_type & 0x7F) {
+        case XCB_CREATE_NOTIFY: {
+            const xcb_create_notify_event_t *ev =
+                (const xcb_create_notify_event_t *)event;
+            if (ev->parent == root && index_of(ev->window) < 0) {
+                window_t *window = add_window(conn, ev->window, false);
+                set_geometry(window, ev->x, ev->y, ev->width, ev->height,
+                             ev->border_width);
+            }
+            break;
+        }
+        case XCB_DESTROY_NOTIFY: {
+            const xcb_destroy_notify_event_t *ev =
+                (const xcb_destroy_notify_event_t *)event;
+            const int i = index_of(ev->window);
+            if (ev->event == root && i >= 0) {
+                remove_at(conn, i);
+            }
+            break;
+        }
+        case XCB_CONFIGURE_NOTIFY: {
+            const xcb_configure_notify_event_t *ev =
+                (const xcb_configure_notify_event_t *)event;
+            const int i = index_of(ev->window);
+            if (ev->event != root || i < 0) {
+                break;
+            }
+            window_t *window = &windows[i];
+            if (ev->width != window->geometry.width ||
+                ev->height != window->geometry.height ||
+                ev->border_width != window->border_width) {
+                release_pixmap(conn, window);
+            }
+            if (window->pending && window->geometry_cookie.sequence != 0) {
+                /* This is newer than the reply. */
+                xcb_discard_reply(conn, window->geometry_cookie.sequence);
+                window->geometry_cookie.sequence = 0;
+            }
+            set_geometry(window, ev->x, ev->y, ev->width, ev->height,
+                         ev->border_width);
+
+            /* The window is now directly above its sibling, or at the bottom
+             * if there is none. */
+            const int sibling = index_of(ev->above_sibling);
+            int position = (sibling < 0) ? 0 : sibling + 1;
+            if (sibling > i) {
+                position--;
+            }
+            restack(i, position);
+            break;
+        }
+        case XCB_MAP_NOTIFY: {
+            const xcb_map_notify_event_t *ev =
+                (const xcb_map_notify_event_t *)event;
+            window_t *window = window_table_find(ev->window);
+            if (ev->event == root && window != NULL) {
+                window->mapped = true;
+                resolve(conn, window, false);
+            }
+            break;
+        }
+        case XCB_UNMAP_NOTIFY: {
+            const xcb_unmap_notify_event_t *ev =
+                (const xcb_unmap_notify_event_t *)event;
+            window_t *window = window_table_find(ev->window);
+            if (ev->event == root && window != NULL) {
+                window->mapped = false;
+                release_pixmap(conn, window);
+            }
+            break;
+        }
+        case XCB_REPARENT_NOTIFY: {
+            const xcb_reparent_notify_event_t *ev =
+                (const xcb_reparent_notify_event_t *)event;
+            const int i = index_of(ev->window);
+            if (ev->parent == root && i < 0) {
+                /* The window keeps its map state, so there may be no
+                 * MapNotify to wait for. */
+                resolve(conn, add_window(conn, ev->window, true), true);
+            } else if (ev->parent != root && i >= 0) {
+                remove_at(conn, i);
+            }
+            break;
+        }
+        case XCB_CIRCULATE_NOTIFY: {
+            const xcb_circulate_notify_event_t *ev =
+                (const xcb_circulate_notify_event_t *)event;
+            const int i = index_of(ev->window);
+            if (ev->event == root && i >= 0) {
+                restack(i, (ev->place == XCB_PLACE_ON_TOP) ? windows_len - 1
+                                                           : 0);
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * Called once the top-level windows are redirected with the Composite
+ * extension.
+ *
+ */
+void window_table_name_pixmaps(void) {
+    name_pixmaps = true;
+}
+
+/*
+ * Returns the drawable to copy the contents of a mapped window from, and the
+ * position of the inside of the window in it. This is the pixmap the Composite
+ * extension renders the window into, which is named on first use and kept
+ * until the window is unmapped or resized. Without redirection it is the
+ * window itself.
+ *
+ */
+xcb_drawable_t window_table_drawable(xcb_connection_t *conn, window_t *window,
+                                     int16_t *x, int16_t *y) {
+    if (!name_pixmaps) {
+        *x = 0;
+        *y = 0;
+        return window->id;
+    }
+    if (window->pixmap == XCB_NONE) {
+        window->pixmap = xcb_generate_id(conn);
+        xcb_composite_name_window_pixmap(conn, window->id, window->pixmap);
+    }
+    /* The pixmap includes the border. */
+    *x = window->border_width;
+    *y = window->border_width;
+    return window->pixmap;
+}
@@ -0,0 +1,43 @@
+#ifndef _WINDOW_TABLE_H
+#define _WINDOW_TABLE_H
+
+#include <stdbool.h>
+#include <xcb/damage.h>
+#include <xcb/xcb.h>
+
+/* A top-level window, that is a child of the root window. */
+typedef struct {
+    xcb_window_t id;
+    /* The inside of the window in root coordinates, without the border. */
+    xcb_rectangle_t geometry;
+    uint16_t border_width;
+    bool input_only;
+    bool mapped;
+    /* The window contents named with the Composite extension, see
+     * window_table_drawable(). */
+    xcb_pixmap_t pixmap;
+    /* The DAMAGE object which reports changes of the window in live fuzzy
+     * mode, XCB_NONE if there is none. The X server destroys it together with
+     * the window. */
+    xcb_damage_damage_t damage;
+    /* Whether the replies to these requests, sent when the window showed up,
+     * still have to be read. */
+    bool pending;
+    xcb_get_window_attributes_cookie_t attributes_cookie;
+    xcb_get_geometry_cookie_t geometry_cookie;
+} window_t;
+
+/* The top-level windows in stacking order, bottom first. */
+extern window_t *windows;
+extern int windows_len;
+
+void window_table_init(xcb_connection_t *conn, xcb_window_t root);
+void window_table_free(xcb_connection_t *conn);
+void window_table_handle_event(xcb_connection_t *conn,
+                               const xcb_generic_event_t *event);
+window_t *window_table_find(xcb_window_t id);
+void window_table_name_pixmaps(void);
+xcb_drawable_t window_table_drawable(xcb_connection_t *conn, window_t *window,
+                                     int16_t *x, int16_t *y);
+
+#endif
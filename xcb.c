@@ -8,9 +8,11 @@
  *
  */
 
+#include <ev.h>
 #include <xcb/composite.h>
 #include <xcb/dpms.h>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_aux.h>
@@ -22,13 +24,17 @@
 #include <assert.h>
 #include <err.h>
 #include <time.h>
-#include <sys/time.h>
+#include <sys/param.h>
 
 #include "cursors.h"
+#include "i3lock.h"
 #include "unlock_indicator.h"
+#include "window_table.h"
 #include "xcb.h"
 
 extern auth_state_t auth_state;
+extern int full_screen_copies;
+extern bool debug_mode;
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
@@ -90,69 +96,154 @@ xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr,
                               u_int32_t *resolution, char *color);
 
-xcb_pixmap_t create_fg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr,
-                              u_int32_t *resolution) {
-    /* Generate a big enough pixmap */
-    xcb_pixmap_t final_pixmap = xcb_generate_id(conn);
-    xcb_create_pixmap(conn, scr->root_depth, final_pixmap, scr->root,
-                      resolution[0], resolution[1]);
-    xcb_gcontext_t gc = xcb_generate_id(conn);
-    const uint32_t gc_values[] = {1};
-    xcb_create_gc(conn, gc, screen->root, XCB_GC_SUBWINDOW_MODE, gc_values);
+/* A set of rectangles which do not overlap. */
+typedef struct {
+    xcb_rectangle_t *rects;
+    int len;
+    int size;
+} rect_set_t;
+
+static void rect_set_add(rect_set_t *set, xcb_rectangle_t rect) {
+    if (set->len == set->size) {
+        set->size = (set->size == 0) ? 16 : 2 * set->size;
+        set->rects = realloc(set->rects, set->size * sizeof(xcb_rectangle_t));
+        if (set->rects == NULL) {
+            err(EXIT_FAILURE, "Could not allocate memory");
+        }
+    }
+    set->rects[set->len++] = rect;
+}
 
-    /* Iterate over all root window children */
-    xcb_query_tree_reply_t *reply =
-        xcb_query_tree_reply(conn, xcb_query_tree(conn, scr->root), NULL);
-    xcb_window_t *children = xcb_query_tree_children(reply);
-    xcb_get_window_attributes_cookie_t *attribs =
-        (xcb_get_window_attributes_cookie_t *)malloc(
-            sizeof(xcb_get_window_attributes_cookie_t) * reply->children_len);
-    xcb_get_geometry_cookie_t *geos = (xcb_get_geometry_cookie_t *)malloc(
-        sizeof(xcb_get_geometry_cookie_t) * reply->children_len);
-
-    if (!attribs || !geos) {
-        goto END;
+static bool intersect_rects(xcb_rectangle_t a, xcb_rectangle_t b,
+                            xcb_rectangle_t *result) {
+    const int x0 = MAX(a.x, b.x);
+    const int y0 = MAX(a.y, b.y);
+    const int x1 = MIN(a.x + a.width, b.x + b.width);
+    const int y1 = MIN(a.y + a.height, b.y + b.height);
+    if (x0 >= x1 || y0 >= y1) {
+        return false;
     }
+    *result = (xcb_rectangle_t){x0, y0, x1 - x0, y1 - y0};
+    return true;
+}
 
-    for (int i = 0; i < reply->children_len; ++i) {
-        /* Get attributes to check if input-only window */
-        attribs[i] = xcb_get_window_attributes(conn, children[i]);
-        geos[i] = xcb_get_geometry(conn, children[i]);
+/*
+ * Removes hole from the set. Each rectangle which overlaps it is replaced by
+ * up to four pieces around the overlap: full-width bands above and below, and
+ * the parts left and right of it.
+ *
+ */
+static void rect_set_subtract(rect_set_t *set, xcb_rectangle_t hole) {
+    const int len = set->len;
+    for (int i = 0; i < len; i++) {
+        const xcb_rectangle_t r = set->rects[i];
+        xcb_rectangle_t overlap;
+        if (!intersect_rects(r, hole, &overlap)) {
+            continue;
+        }
+        /* Mark the rectangle for removal, the pieces go to the end. */
+        set->rects[i].width = 0;
+        if (overlap.y > r.y) {
+            rect_set_add(set, (xcb_rectangle_t){r.x, r.y, r.width,
+                                                overlap.y - r.y});
+        }
+        if (overlap.y + overlap.height < r.y + r.height) {
+            rect_set_add(set, (xcb_rectangle_t){
+                                  r.x, overlap.y + overlap.height, r.width,
+                                  r.y + r.height - overlap.y - overlap.height});
+        }
+        if (overlap.x > r.x) {
+            rect_set_add(set, (xcb_rectangle_t){r.x, overlap.y,
+                                                overlap.x - r.x,
+                                                overlap.height});
+        }
+        if (overlap.x + overlap.width < r.x + r.width) {
+            rect_set_add(set, (xcb_rectangle_t){
+                                  overlap.x + overlap.width, overlap.y,
+                                  r.x + r.width - overlap.x - overlap.width,
+                                  overlap.height});
+        }
     }
 
-    /* Copy root window background to final_pixmap */
-    xcb_copy_area(conn, scr->root, final_pixmap, gc, 0, 0, 0, 0, resolution[0],
-                  resolution[1]);
+    int kept = 0;
+    for (int i = 0; i < set->len; i++) {
+        if (set->rects[i].width > 0) {
+            set->rects[kept++] = set->rects[i];
+        }
+    }
+    set->len = kept;
+}
 
-    for (int i = 0; i < reply->children_len; ++i) {
-        /* Get attributes to check if input-only window */
-        xcb_get_window_attributes_reply_t *attrib =
-            xcb_get_window_attributes_reply(conn, attribs[i], NULL);
+/*
+ * Copies the given area of the screen, that is the root window and the
+ * top-level windows on it, into the same area of pixmap. The windows are
+ * taken from the window table, so this sends no requests with replies.
+ *
+ * Going from the topmost window down, each window only copies the part of
+ * area which no window above it covers, and the root window fills in the
+ * rest. Every pixel is copied once, no matter how many windows overlap.
+ *
+ */
+void capture_screen(xcb_connection_t *conn, xcb_screen_t *scr,
+                    xcb_pixmap_t pixmap, xcb_rectangle_t area) {
+    window_table_init(conn, scr->root);
+
+    xcb_gcontext_t gc = xcb_generate_id(conn);
+    const uint32_t gc_values[] = {1};
+    xcb_create_gc(conn, gc, screen->root, XCB_GC_SUBWINDOW_MODE, gc_values);
 
-        /* If attributes are NULL then the window was destroyed */
-        if (!attrib) {
+    rect_set_t uncovered = {NULL, 0, 0};
+    rect_set_add(&uncovered, area);
+    int copies = 0;
+
+    for (int i = windows_len - 1; i >= 0 && uncovered.len > 0; --i) {
+        window_t *window = &windows[i];
+        if (!window->mapped || window->input_only) {
             continue;
         }
 
-        if (attrib->_class == XCB_WINDOW_CLASS_INPUT_ONLY) {
-            free(attrib);
-            continue;
+        const xcb_rectangle_t geo = window->geometry;
+        int16_t x, y;
+        xcb_drawable_t source = XCB_NONE;
+        for (int j = 0; j < uncovered.len; j++) {
+            xcb_rectangle_t visible;
+            if (intersect_rects(uncovered.rects[j], geo, &visible)) {
+                if (source == XCB_NONE) {
+                    source = window_table_drawable(conn, window, &x, &y);
+                }
+                xcb_copy_area(conn, source, pixmap, gc, x + visible.x - geo.x,
+                              y + visible.y - geo.y, visible.x, visible.y,
+                              visible.width, visible.height);
+                copies++;
+            }
         }
-        free(attrib);
-
-        /* Copy area to final_pixmap */
-        xcb_get_geometry_reply_t *geo =
-            xcb_get_geometry_reply(conn, geos[i], NULL);
-        xcb_copy_area(conn, children[i], final_pixmap, gc, 0, 0, geo->x, geo->y,
-                      geo->width, geo->height);
-        free(geo);
+        rect_set_subtract(&uncovered, geo);
     }
-    free(geos);
-    free(attribs);
-END:
-    free(reply);
 
+    /* Copy root window background to the parts no window covers */
+    for (int j = 0; j < uncovered.len; j++) {
+        const xcb_rectangle_t r = uncovered.rects[j];
+        xcb_copy_area(conn, scr->root, pixmap, gc, r.x, r.y, r.x, r.y, r.width,
+                      r.height);
+        copies++;
+    }
+    DEBUG("capture of %dx%d+%d+%d: %d copies\n", area.width, area.height,
+          area.x, area.y, copies);
+
+    free(uncovered.rects);
     xcb_free_gc(conn, gc);
+}
+
+xcb_pixmap_t create_fg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr,
+                              u_int32_t *resolution) {
+    /* Generate a big enough pixmap */
+    xcb_pixmap_t final_pixmap = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, scr->root_depth, final_pixmap, scr->root,
+                      resolution[0], resolution[1]);
+
+    const xcb_rectangle_t area = {0, 0, resolution[0], resolution[1]};
+    capture_screen(conn, scr, final_pixmap, area);
+    full_screen_copies++;
 
     return final_pixmap;
 }
@@ -171,6 +262,7 @@ xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr,
     xcb_rectangle_t rect = {0, 0, resolution[0], resolution[1]};
     xcb_poly_fill_rectangle(conn, bg_pixmap, gc, 1, &rect);
     xcb_free_gc(conn, gc);
+    full_screen_copies++;
 
     return bg_pixmap;
 }
@@ -191,6 +283,7 @@ xcb_window_t open_overlay_window(xcb_connection_t *conn, xcb_screen_t *scr) {
 
     xcb_composite_redirect_subwindows(conn, scr->root,
                                       XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+    window_table_name_pixmaps();
 
     xcb_change_window_attributes(
         conn, scr->root, XCB_CW_EVENT_MASK,
@@ -200,6 +293,20 @@ xcb_window_t open_overlay_window(xcb_connection_t *conn, xcb_screen_t *scr) {
     return win;
 }
 
+/*
+ * Undoes open_overlay_window() when i3lock keeps running after unlocking, see
+ * --daemon. The top-level windows are drawn directly to the screen again.
+ *
+ */
+void close_overlay_window(xcb_connection_t *conn, xcb_screen_t *scr) {
+    xcb_change_window_attributes(
+        conn, scr->root, XCB_CW_EVENT_MASK,
+        (uint32_t[1]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+    xcb_composite_unredirect_subwindows(conn, scr->root,
+                                        XCB_COMPOSITE_REDIRECT_AUTOMATIC);
+    xcb_composite_release_overlay_window(conn, scr->root);
+}
+
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr,
                                     char *color, xcb_pixmap_t pixmap) {
     uint32_t mask = 0;
@@ -248,102 +355,153 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr,
     return win;
 }
 
+/* Grabbing the pointer and keyboard fails while another client holds a grab,
+ * e.g. an open menu, so it is retried from a timer. The event loop keeps
+ * running in the meantime. */
+#define GRAB_RETRY_INTERVAL 0.005
+/* After this long the "locking…" message is shown. */
+#define GRAB_LOCKING_DELAY 0.1
+/* After this long the input focus is moved to the lock window, which closes
+ * context menus that would otherwise keep their grab. */
+#define GRAB_FOCUS_DELAY 0.5
+/* After this long locking fails. */
+#define GRAB_TIMEOUT 5.0
+
+static struct {
+    xcb_connection_t *conn;
+    xcb_screen_t *screen;
+    xcb_window_t win;
+    xcb_cursor_t cursor;
+    void (*done)(bool grabbed);
+    enum { GRAB_POINTER, GRAB_KEYBOARD } state;
+    /* The sequence number of the grab request in flight, 0 if none. */
+    unsigned int sequence;
+    int failures;
+    bool locking_shown;
+    bool focus_set;
+    ev_tstamp start;
+    struct ev_timer timer;
+} grab;
+
+static void send_grab_request(void) {
+    if (grab.state == GRAB_POINTER) {
+        grab.sequence =
+            xcb_grab_pointer(
+                grab.conn,
+                false, /* get all pointer events specified by the following mask */
+                grab.screen->root,   /* grab the root window */
+                XCB_NONE,            /* which events to let through */
+                XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
+                XCB_GRAB_MODE_ASYNC, /* keyboard mode */
+                XCB_NONE, /* confine_to = in which window should the cursor stay */
+                grab.cursor, /* we change the cursor to whatever the user wanted */
+                XCB_CURRENT_TIME)
+                .sequence;
+    } else {
+        grab.sequence =
+            xcb_grab_keyboard(grab.conn, true,     /* report events */
+                              grab.screen->root, /* grab the root window */
+                              XCB_CURRENT_TIME,
+                              XCB_GRAB_MODE_ASYNC, /* process events as
+                                                      normal, do not
+                                                      require sync */
+                              XCB_GRAB_MODE_ASYNC)
+                .sequence;
+    }
+    xcb_flush(grab.conn);
+}
+
+static void finish_grab(struct ev_loop *loop, bool grabbed) {
+    ev_timer_stop(loop, &grab.timer);
+    DEBUG("grab: %s after %.1f ms and %d failed attempts\n",
+          grabbed ? "pointer and keyboard grabbed" : "giving up",
+          (ev_now(loop) - grab.start) * 1e3, grab.failures);
+    grab.done(grabbed);
+}
+
 /*
- * Repeatedly tries to grab pointer and keyboard (up to the specified number of
- * tries).
- *
- * Returns true if the grab succeeded, false if not.
+ * Reads the reply to the grab request in flight, if it arrived, and sends the
+ * next one.
  *
  */
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries) {
-    xcb_grab_pointer_cookie_t pcookie;
-    xcb_grab_pointer_reply_t *preply;
-
-    xcb_grab_keyboard_cookie_t kcookie;
-    xcb_grab_keyboard_reply_t *kreply;
-
-    const suseconds_t screen_redraw_timeout = 100000; /* 100ms */
-
-    /* Using few variables to trigger a redraw_screen() if too many tries */
-    bool redrawn = false;
-    struct timeval start;
-    if (gettimeofday(&start, NULL) == -1) {
-        err(EXIT_FAILURE, "gettimeofday");
-    }
-
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
-            false, /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
-            XCB_NONE,            /* which events to let through */
-            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
-            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
-            XCB_NONE, /* confine_to = in which window should the cursor stay */
-            cursor,   /* we change the cursor to whatever the user wanted */
-            XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
+static void grab_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+    if (grab.sequence != 0) {
+        void *reply = NULL;
+        xcb_generic_error_t *error = NULL;
+        if (!xcb_poll_for_reply(grab.conn, grab.sequence, &reply, &error)) {
+            /* Not there yet. */
+            return;
         }
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
+        grab.sequence = 0;
+        /* Pointer and keyboard grab replies look the same. */
+        const bool success =
+            reply != NULL && ((xcb_grab_pointer_reply_t *)reply)->status ==
+                                 XCB_GRAB_STATUS_SUCCESS;
+        free(reply);
+        free(error);
+
+        if (success && grab.state == GRAB_KEYBOARD) {
+            finish_grab(loop, true);
+            return;
         }
-
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
-
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
+        if (success) {
+            DEBUG("grab: pointer grabbed after %.1f ms\n",
+                  (ev_now(loop) - grab.start) * 1e3);
+            grab.state = GRAB_KEYBOARD;
+        } else {
+            grab.failures++;
         }
     }
 
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(conn, true,   /* report events */
-                                    screen->root, /* grab the root window */
-                                    XCB_CURRENT_TIME,
-                                    XCB_GRAB_MODE_ASYNC, /* process events as
-                                                            normal, do not
-                                                            require sync */
-                                    XCB_GRAB_MODE_ASYNC);
-
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
-
-        /* Make this quite a bit slower */
-        usleep(50);
-
-        struct timeval now;
-        if (gettimeofday(&now, NULL) == -1) {
-            err(EXIT_FAILURE, "gettimeofday");
-        }
-
-        struct timeval elapsed;
-        timersub(&now, &start, &elapsed);
-
-        /* Trigger a screen redraw if 100ms elapsed */
-        if (!redrawn &&
-            (tries % 100) == 0 &&
-            elapsed.tv_usec >= screen_redraw_timeout) {
-            redraw_screen();
-            redrawn = true;
-        }
+    const ev_tstamp elapsed = ev_now(loop) - grab.start;
+    if (elapsed >= GRAB_TIMEOUT) {
+        finish_grab(loop, false);
+        return;
+    }
+    if (!grab.locking_shown && elapsed >= GRAB_LOCKING_DELAY) {
+        grab.locking_shown = true;
+        redraw_unlock_indicator();
     }
+    if (!grab.focus_set && elapsed >= GRAB_FOCUS_DELAY) {
+        grab.focus_set = true;
+        DEBUG("grab: still failing, setting the input focus to 0x%08x\n",
+              grab.win);
+        /* We cannot use set_focused_window because _NET_ACTIVE_WINDOW only
+         * works for managed windows, but i3lock uses an unmanaged window
+         * (override_redirect=1). */
+        xcb_set_input_focus(grab.conn, XCB_INPUT_FOCUS_PARENT /* revert_to */,
+                            grab.win, XCB_CURRENT_TIME);
+    }
+    send_grab_request();
+}
 
-    return (tries > 0);
+/*
+ * Starts grabbing the pointer and then the keyboard. done is called from the
+ * event loop once both are grabbed, or with false if that did not work within
+ * GRAB_TIMEOUT seconds.
+ *
+ */
+void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen,
+                               xcb_window_t win, xcb_cursor_t cursor,
+                               struct ev_loop *loop,
+                               void (*done)(bool grabbed)) {
+    /* In daemon mode, this runs once per lock. The timer of the previous
+     * grab was stopped when it finished. */
+    memset(&grab, 0, sizeof(grab));
+    grab.conn = conn;
+    grab.screen = screen;
+    grab.win = win;
+    grab.cursor = cursor;
+    grab.done = done;
+    grab.state = GRAB_POINTER;
+    ev_now_update(loop);
+    grab.start = ev_now(loop);
+
+    /* The first attempt is on its way while the caller goes on. */
+    send_grab_request();
+    ev_timer_init(&grab.timer, grab_cb, GRAB_RETRY_INTERVAL,
+                  GRAB_RETRY_INTERVAL);
+    ev_timer_start(loop, &grab.timer);
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen,
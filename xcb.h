@@ -1,6 +1,8 @@
 #ifndef _XCB_H
 #define _XCB_H
 
+#include <ev.h>
+#include <stdbool.h>
 #include <xcb/dpms.h>
 #include <xcb/xcb.h>
 
@@ -8,11 +10,16 @@ extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
+void capture_screen(xcb_connection_t *conn, xcb_screen_t *scr, xcb_pixmap_t pixmap, xcb_rectangle_t area);
 xcb_pixmap_t create_fg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
 xcb_window_t open_overlay_window(xcb_connection_t *conn, xcb_screen_t *scr);
+void close_overlay_window(xcb_connection_t *conn, xcb_screen_t *scr);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor, int tries);
+void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen,
+                               xcb_window_t win, xcb_cursor_t cursor,
+                               struct ev_loop *loop,
+                               void (*done)(bool grabbed));
 void dpms_set_mode(xcb_connection_t *conn, xcb_dpms_dpms_mode_t mode);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 xcb_window_t find_focused_window(xcb_connection_t *conn, const xcb_window_t root);